@@ -0,0 +1,177 @@
+#include "dsh.h"
+#include <pthread.h>
+
+/* Bump allocator backing everything readcommandline() builds for one
+ * command line: the job_t/process_t structs, argv arrays and strings and
+ * the redirection file names.  Nothing inside an arena is freed on its own;
+ * the whole arena goes back to a small pool once the last job parsed from
+ * the line is released, so steady state parsing does not touch malloc. */
+
+#define ARENA_MIN_CHUNK  1024
+#define ARENA_ALIGN      (sizeof(void *) > sizeof(long long) ? sizeof(void *) : sizeof(long long))
+#define ARENA_POOL_MAX   8
+
+typedef struct arena_chunk {
+	struct arena_chunk *next;
+	size_t size;                /* usable bytes in data[] */
+	size_t used;
+	char data[];
+} arena_chunk_t;
+
+struct arena {
+	arena_chunk_t *head;        /* chunk currently bumped from */
+	int refs;                   /* jobs still pointing into this arena */
+	struct arena *next_free;    /* pool link */
+};
+
+static arena_t *arena_pool = NULL;
+static int arena_pool_len = 0;
+static pthread_mutex_t arena_pool_lock = PTHREAD_MUTEX_INITIALIZER;    /* batch mode parses on a second thread */
+static pthread_once_t arena_fork_once = PTHREAD_ONCE_INIT;
+
+/* A parallel for loop forks dsh itself while the batch thread may be
+ * parsing; fork() holds the pool lock so the worker gets a consistent pool */
+static void arena_fork_lock(void)
+{
+	pthread_mutex_lock(&arena_pool_lock);
+}
+
+static void arena_fork_unlock(void)
+{
+	pthread_mutex_unlock(&arena_pool_lock);
+}
+
+static void arena_fork_init(void)
+{
+	pthread_atfork(arena_fork_lock, arena_fork_unlock, arena_fork_unlock);
+}
+
+static arena_chunk_t *arena_new_chunk(size_t size)
+{
+	if(size < ARENA_MIN_CHUNK)
+		size = ARENA_MIN_CHUNK;
+	arena_chunk_t *c = (arena_chunk_t *)malloc(sizeof(arena_chunk_t) + size);
+	if(!c)
+		return NULL;
+	c->next = NULL;
+	c->size = size;
+	c->used = 0;
+	return c;
+}
+
+/* Create an arena whose first chunk can hold at least size_hint bytes.  A
+ * pooled arena is reused when its first chunk is big enough. */
+arena_t *arena_create(size_t size_hint)
+{
+	pthread_once(&arena_fork_once, arena_fork_init);
+	pthread_mutex_lock(&arena_pool_lock);
+	arena_t **link = &arena_pool;
+	for(arena_t *a = arena_pool; a; link = &a->next_free, a = a->next_free) {
+		if(a->head->size >= size_hint) {
+			*link = a->next_free;
+			arena_pool_len--;
+			pthread_mutex_unlock(&arena_pool_lock);
+			a->next_free = NULL;
+			a->refs = 0;
+			return a;
+		}
+	}
+	pthread_mutex_unlock(&arena_pool_lock);
+
+	arena_t *a = (arena_t *)malloc(sizeof(arena_t));
+	if(!a)
+		return NULL;
+	if(!(a->head = arena_new_chunk(size_hint))) {
+		free(a);
+		return NULL;
+	}
+	a->refs = 0;
+	a->next_free = NULL;
+	return a;
+}
+
+void *arena_alloc(arena_t *a, size_t n)
+{
+	n = (n + ARENA_ALIGN - 1) & ~(ARENA_ALIGN - 1);
+	if(a->head->used + n > a->head->size) {
+		/* grow geometrically so a long line costs O(log n) mallocs */
+		arena_chunk_t *c = arena_new_chunk(n > a->head->size * 2 ? n : a->head->size * 2);
+		if(!c)
+			return NULL;
+		c->next = a->head;
+		a->head = c;
+	}
+	void *p = a->head->data + a->head->used;
+	a->head->used += n;
+	return p;
+}
+
+void *arena_calloc(arena_t *a, size_t n)
+{
+	void *p = arena_alloc(a, n);
+	if(p)
+		memset(p, 0, n);
+	return p;
+}
+
+/* Copy len bytes of s into the arena and NUL terminate the copy */
+char *arena_strndup(arena_t *a, const char *s, size_t len)
+{
+	char *d = (char *)arena_alloc(a, len + 1);
+	if(!d)
+		return NULL;
+	memcpy(d, s, len);
+	d[len] = '\0';
+	return d;
+}
+
+/* Drop everything allocated so far.  Only the largest chunk is kept so the
+ * next line of the same size fits without another malloc. */
+void arena_reset(arena_t *a)
+{
+	arena_chunk_t *keep = a->head;
+	for(arena_chunk_t *c = a->head->next; c; ) {
+		arena_chunk_t *next = c->next;
+		if(c->size > keep->size) {
+			free(keep);
+			keep = c;
+		} else {
+			free(c);
+		}
+		c = next;
+	}
+	keep->next = NULL;
+	keep->used = 0;
+	a->head = keep;
+}
+
+void arena_destroy(arena_t *a)
+{
+	if(!a)
+		return;
+	arena_reset(a);
+	pthread_mutex_lock(&arena_pool_lock);
+	if(arena_pool_len < ARENA_POOL_MAX) {
+		a->next_free = arena_pool;
+		arena_pool = a;
+		arena_pool_len++;
+		pthread_mutex_unlock(&arena_pool_lock);
+		return;
+	}
+	pthread_mutex_unlock(&arena_pool_lock);
+	free(a->head);
+	free(a);
+}
+
+void arena_retain(arena_t *a)
+{
+	if(a)
+		a->refs++;
+}
+
+/* Called once per job; the arena is recycled with the last job */
+void arena_release(arena_t *a)
+{
+	if(a && --a->refs <= 0)
+		arena_destroy(a);
+}
@@ -0,0 +1,232 @@
+#include "dsh.h"
+#include <sys/mman.h>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <condition_variable>
+#include <thread>
+#include <vector>
+
+using namespace std;
+
+/* Batch mode: dsh -f script, or stdin redirected from a regular file.
+ * Piped stdin is not read ahead: the commands it starts may read the same
+ * pipe, and must find the lines after their own still there.
+ *
+ * A helper thread owns the input.  A regular file is mmap'd whole; anything
+ * else (a script named by a FIFO, say) is read in BATCH_BLOCK sized blocks,
+ * and only a line that straddles two blocks is ever copied.  Lines are split in place and each
+ * one is parsed right away, so while the main thread waits on a job the next
+ * BATCH_AHEAD lines are already turned into job lists.  The main thread pops
+ * them in order with batch_next(), or as raw text with batch_getline() when
+ * it is in the interactive shell mode.  What the parser has to say about a
+ * line is kept with it and printed when the line is run. */
+
+#define BATCH_BLOCK (64 * 1024)
+
+typedef shared_ptr<vector<char>> block_ref;
+
+struct batch_line
+{
+    const char *text;   /* not NUL terminated */
+    size_t len;
+    job_t *jobs;        /* parsed ahead; NULL for blank lines and parse errors */
+    string warnings;    /* what parsing it printed though it succeeded */
+    block_ref block;    /* keeps a read block alive until the line is consumed */
+};
+
+struct batch_state
+{
+    int fd;
+    const char *map;    /* mmap'd input, or NULL when reading blocks */
+    size_t map_len;
+    mutex lock;
+    condition_variable not_empty, not_full;
+    deque<batch_line> queue;
+    bool eof;
+};
+
+/* never freed: the helper may still be blocked on the queue when dsh exits */
+static batch_state *batch = NULL;
+
+static void batch_push(const char *text, size_t len, const block_ref &block)
+{
+    if (len && text[len - 1] == '\r')
+    {
+        len--;
+    }
+    batch_line l = {text, len, NULL, "", block};
+    parse_messages = &l.warnings;
+    l.jobs = parse_commandline(text, len);
+    parse_messages = NULL;
+
+    unique_lock<mutex> guard(batch->lock);
+    batch->not_full.wait(guard, [] { return batch->queue.size() < BATCH_AHEAD; });
+    batch->queue.push_back(l);
+    batch->not_empty.notify_one();
+}
+
+static void batch_reader()
+{
+    if (batch->map)
+    {
+        const char *p = batch->map, *end = batch->map + batch->map_len;
+        while (p < end)
+        {
+            const char *nl = (const char *)memchr(p, '\n', end - p);
+            const char *eol = nl ? nl : end;
+            batch_push(p, eol - p, nullptr);
+            p = eol + 1;
+        }
+    }
+    else
+    {
+        block_ref block;
+        size_t carry = 0; /* bytes of an unfinished line at the start of block */
+        while (1)
+        {
+            block_ref next = make_shared<vector<char>>(carry + BATCH_BLOCK);
+            if (carry)
+            {
+                memcpy(next->data(), block->data() + block->size() - carry, carry);
+            }
+            ssize_t n;
+            do
+            {
+                n = read(batch->fd, next->data() + carry, BATCH_BLOCK);
+            } while (n < 0 && errno == EINTR);
+            if (n <= 0)
+            {
+                if (carry)
+                {
+                    next->resize(carry);
+                    batch_push(next->data(), carry, next);
+                }
+                break;
+            }
+            next->resize(carry + n);
+            block = next;
+
+            const char *p = block->data(), *end = block->data() + block->size();
+            while (1)
+            {
+                const char *nl = (const char *)memchr(p, '\n', end - p);
+                if (!nl)
+                {
+                    break;
+                }
+                batch_push(p, nl - p, block);
+                p = nl + 1;
+            }
+            carry = end - p;
+        }
+    }
+
+    lock_guard<mutex> guard(batch->lock);
+    batch->eof = true;
+    batch->not_empty.notify_all();
+}
+
+/* Start batch mode on path, or on stdin when path is NULL */
+bool batch_open(const char *path)
+{
+    int fd = path ? open(path, O_RDONLY | O_CLOEXEC) : STDIN_FILENO;
+    if (fd < 0)
+    {
+        perror(path);
+        return false;
+    }
+
+    batch = new batch_state();
+    batch->fd = fd;
+    batch->map = NULL;
+    batch->map_len = 0;
+    batch->eof = false;
+
+    struct stat st;
+    if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0)
+    {
+        /* a script handed over on stdin is mapped from where dsh stands in it */
+        off_t start = path ? 0 : lseek(fd, 0, SEEK_CUR);
+        if (start >= 0 && start < st.st_size)
+        {
+            void *m = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+            if (m != MAP_FAILED)
+            {
+                madvise(m, st.st_size, MADV_SEQUENTIAL);
+                batch->map = (const char *)m + start;
+                batch->map_len = st.st_size - start;
+            }
+        }
+        else if (start == st.st_size)
+        {
+            batch->eof = true;
+            return true;
+        }
+    }
+
+    thread(batch_reader).detach();
+    return true;
+}
+
+bool batch_active()
+{
+    return batch != NULL;
+}
+
+static bool batch_pop(batch_line *l)
+{
+    unique_lock<mutex> guard(batch->lock);
+    batch->not_empty.wait(guard, [] { return !batch->queue.empty() || batch->eof; });
+    if (batch->queue.empty())
+    {
+        return false;
+    }
+    *l = batch->queue.front();
+    batch->queue.pop_front();
+    batch->not_full.notify_one();
+    return true;
+}
+
+/* Next command line as a parsed job list.  NULL with *eof false means a
+ * blank or invalid line; the latter is parsed again here so its error is
+ * printed in order with the rest of the output. */
+job_t *batch_next(bool *eof)
+{
+    batch_line l;
+    *eof = !batch_pop(&l);
+    if (*eof)
+    {
+        return NULL;
+    }
+    if (!l.jobs && l.len)
+    {
+        return readcommandline(string(l.text, l.len).c_str());
+    }
+    parse_report(l.warnings);
+    return l.jobs;
+}
+
+/* Next line as plain text (for the interactive shell mode); whatever the
+ * helper parsed ahead for it is dropped.  The text stays valid until the
+ * following call. */
+bool batch_getline(char **line, size_t *len)
+{
+    static string current;
+    batch_line l;
+    if (!batch_pop(&l))
+    {
+        return false;
+    }
+    /* the shell mode parses the line again, warnings and all */
+    for (job_t *j = l.jobs; j;)
+    {
+        job_t *next = j->next;
+        free_job(j);
+        j = next;
+    }
+    current.assign(l.text, l.len);
+    *line = &current[0];
+    *len = current.size();
+    return true;
+}
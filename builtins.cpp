@@ -0,0 +1,514 @@
+#include "dsh.h"
+#include <string>
+#include <strings.h>
+#include <limits.h>
+
+using namespace std;
+
+/* Fast builtins: small utilities that for loops call all the time and that
+ * are cheaper to run inside dsh than to fork and exec.  spawn_job() runs
+ * them in place of a foreground pipeline stage: on its own thread when the
+ * stage feeds a pipe, inline otherwise.  They never read stdin, and their
+ * output goes to a fast_out_t: the stage's pipe or file, or memory when dsh
+ * reports the output itself. */
+
+#define FAST_OUT_FLUSH 4096
+
+static void out_flush(fast_out_t *out)
+{
+    if (out->fd < 0 || out->buf.empty())
+    {
+        return;
+    }
+    const char *p = out->buf.data();
+    size_t left = out->buf.size();
+    while (left && !out->broken)
+    {
+        ssize_t n = write(out->fd, p, left);
+        if (n < 0)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            out->broken = true; /* EPIPE: the reader is gone, drop the rest */
+            break;
+        }
+        p += n;
+        left -= n;
+    }
+    out->buf.clear();
+}
+
+static void out_write(fast_out_t *out, const char *s, size_t len)
+{
+    out->buf.append(s, len);
+    if (out->buf.size() >= FAST_OUT_FLUSH)
+    {
+        out_flush(out);
+    }
+}
+
+static void out_puts(fast_out_t *out, const char *s)
+{
+    out_write(out, s, strlen(s));
+}
+
+static void out_putc(fast_out_t *out, char c)
+{
+    out_write(out, &c, 1);
+}
+
+/* Expand a backslash escape at s (just past the backslash) into out;
+ * returns the number of characters consumed, or -1 for \c (stop output) */
+static int expand_escape(const char *s, fast_out_t *out)
+{
+    switch (*s)
+    {
+    case 'n': out_putc(out, '\n'); return 1;
+    case 't': out_putc(out, '\t'); return 1;
+    case 'r': out_putc(out, '\r'); return 1;
+    case 'a': out_putc(out, '\a'); return 1;
+    case 'b': out_putc(out, '\b'); return 1;
+    case 'f': out_putc(out, '\f'); return 1;
+    case 'v': out_putc(out, '\v'); return 1;
+    case '\\': out_putc(out, '\\'); return 1;
+    case 'c': return -1;
+    case '0':
+    {
+        int v = 0, n = 1;
+        while (n < 4 && s[n] >= '0' && s[n] <= '7')
+        {
+            v = v * 8 + (s[n++] - '0');
+        }
+        out_putc(out, (char)v);
+        return n;
+    }
+    case '\0':
+        out_putc(out, '\\');
+        return 0;
+    default:
+        out_putc(out, '\\');
+        out_putc(out, *s);
+        return 1;
+    }
+}
+
+static int fb_true(int, char **, fast_out_t *)
+{
+    return 0;
+}
+
+static int fb_false(int, char **, fast_out_t *)
+{
+    return 1;
+}
+
+static int fb_echo(int argc, char **argv, fast_out_t *out)
+{
+    bool newline = true, escapes = false;
+    int i = 1;
+    for (; i < argc && argv[i][0] == '-' && argv[i][1]; i++)
+    {
+        const char *f = argv[i] + 1;
+        if (strspn(f, "neE") != strlen(f))
+        {
+            break; /* not an option, e.g. "echo -x" */
+        }
+        for (; *f; f++)
+        {
+            if (*f == 'n')
+                newline = false;
+            else
+                escapes = (*f == 'e');
+        }
+    }
+    for (int first = i; i < argc; i++)
+    {
+        if (i > first)
+        {
+            out_putc(out, ' ');
+        }
+        if (!escapes)
+        {
+            out_puts(out, argv[i]);
+            continue;
+        }
+        for (const char *s = argv[i]; *s; s++)
+        {
+            if (*s != '\\')
+            {
+                out_putc(out, *s);
+                continue;
+            }
+            int n = expand_escape(s + 1, out);
+            if (n < 0)
+            {
+                return 0;
+            }
+            s += n;
+        }
+    }
+    if (newline)
+    {
+        out_putc(out, '\n');
+    }
+    return 0;
+}
+
+static int fb_pwd(int, char **, fast_out_t *out)
+{
+    char cwd[PATH_MAX];
+    if (!getcwd(cwd, sizeof(cwd)))
+    {
+        perror("pwd");
+        return 1;
+    }
+    out_puts(out, cwd);
+    out_putc(out, '\n');
+    return 0;
+}
+
+/* printf FORMAT [ARG...]: %s %b %c %d %i %u %o %x %X %% with flags, width
+ * and precision; the format is reused while arguments are left */
+static int fb_printf(int argc, char **argv, fast_out_t *out)
+{
+    if (argc < 2)
+    {
+        fprintf(stderr, "printf: usage: printf format [arguments]\n");
+        return 2;
+    }
+    const char *fmt = argv[1];
+    int arg = 2, rc = 0;
+    do
+    {
+        int consumed = arg;
+        for (const char *s = fmt; *s; s++)
+        {
+            if (*s == '\\')
+            {
+                int n = expand_escape(s + 1, out);
+                if (n < 0)
+                {
+                    return rc;
+                }
+                s += n;
+                continue;
+            }
+            if (*s != '%')
+            {
+                out_putc(out, *s);
+                continue;
+            }
+            if (s[1] == '%')
+            {
+                out_putc(out, '%');
+                s++;
+                continue;
+            }
+            /* copy the conversion spec: flags, width, precision, type; keep
+               room for the "ll", the conversion and the terminator */
+            char spec[32] = "%";
+            size_t n = 1;
+            const char *c = s + 1;
+            while (*c && strchr("-+ #0123456789.", *c) && n < sizeof(spec) - 4)
+            {
+                spec[n++] = *c++;
+            }
+            const char *val = arg < argc ? argv[arg++] : NULL;
+            char buf[512];
+            switch (*c)
+            {
+            case 'd': case 'i': case 'u': case 'o': case 'x': case 'X':
+            {
+                char *end = NULL;
+                long long v = val ? strtoll(val, &end, 0) : 0;
+                if (val && (*end || end == val))
+                {
+                    fprintf(stderr, "printf: %s: invalid number\n", val);
+                    rc = 1;
+                }
+                spec[n++] = 'l';
+                spec[n++] = 'l';
+                spec[n++] = *c;
+                spec[n] = '\0';
+                snprintf(buf, sizeof(buf), spec, v);
+                out_puts(out, buf);
+                break;
+            }
+            case 'c':
+                spec[n++] = 'c';
+                spec[n] = '\0';
+                snprintf(buf, sizeof(buf), spec, val && *val ? val[0] : '\0');
+                out_puts(out, buf);
+                break;
+            case 'b':
+                for (const char *b = val ? val : ""; *b; b++)
+                {
+                    if (*b != '\\')
+                    {
+                        out_putc(out, *b);
+                        continue;
+                    }
+                    int k = expand_escape(b + 1, out);
+                    if (k < 0)
+                    {
+                        return rc;
+                    }
+                    b += k;
+                }
+                break;
+            case 's':
+                spec[n++] = 's';
+                spec[n] = '\0';
+                if (strlen(val ? val : "") < sizeof(buf) / 2)
+                {
+                    snprintf(buf, sizeof(buf), spec, val ? val : "");
+                    out_puts(out, buf);
+                }
+                else
+                {
+                    out_puts(out, val); /* too long to need padding */
+                }
+                break;
+            default:
+                fprintf(stderr, "printf: %%%c: invalid directive\n", *c ? *c : ' ');
+                return 1;
+            }
+            s = c;
+        }
+        if (arg == consumed)
+        {
+            break; /* format takes no arguments */
+        }
+    } while (arg < argc);
+    return rc;
+}
+
+static bool test_unary(const char *op, const char *arg, bool *ok)
+{
+    struct stat st;
+    *ok = true;
+    switch (op[1])
+    {
+    case 'z': return arg[0] == '\0';
+    case 'n': return arg[0] != '\0';
+    case 'e': return stat(arg, &st) == 0;
+    case 'f': return stat(arg, &st) == 0 && S_ISREG(st.st_mode);
+    case 'd': return stat(arg, &st) == 0 && S_ISDIR(st.st_mode);
+    case 'h':
+    case 'L': return lstat(arg, &st) == 0 && S_ISLNK(st.st_mode);
+    case 's': return stat(arg, &st) == 0 && st.st_size > 0;
+    case 'r': return access(arg, R_OK) == 0;
+    case 'w': return access(arg, W_OK) == 0;
+    case 'x': return access(arg, X_OK) == 0;
+    }
+    *ok = false;
+    return false;
+}
+
+static bool test_binary(const char *l, const char *op, const char *r, bool *ok)
+{
+    *ok = true;
+    if (!strcmp(op, "=") || !strcmp(op, "=="))
+        return strcmp(l, r) == 0;
+    if (!strcmp(op, "!="))
+        return strcmp(l, r) != 0;
+    long long a = atoll(l), b = atoll(r);
+    if (!strcmp(op, "-eq")) return a == b;
+    if (!strcmp(op, "-ne")) return a != b;
+    if (!strcmp(op, "-lt")) return a < b;
+    if (!strcmp(op, "-le")) return a <= b;
+    if (!strcmp(op, "-gt")) return a > b;
+    if (!strcmp(op, "-ge")) return a >= b;
+    *ok = false;
+    return false;
+}
+
+/* test EXPR / [ EXPR ]: the 0 to 4 argument forms of POSIX test */
+static int fb_test(int argc, char **argv, fast_out_t *)
+{
+    if (!strcmp(argv[0], "["))
+    {
+        if (strcmp(argv[argc - 1], "]"))
+        {
+            fprintf(stderr, "[: missing `]'\n");
+            return 2;
+        }
+        argc--;
+    }
+    char **a = argv + 1;
+    int n = argc - 1;
+    bool negate = false, ok = true, r = false;
+    if (n > 1 && !strcmp(a[0], "!") && n != 3)
+    {
+        negate = true;
+        a++;
+        n--;
+    }
+    switch (n)
+    {
+    case 0: r = false; break;
+    case 1: r = a[0][0] != '\0'; break;
+    case 2: r = a[0][0] == '-' && test_unary(a[0], a[1], &ok); break;
+    case 3:
+        r = test_binary(a[0], a[1], a[2], &ok);
+        if (!ok && !strcmp(a[0], "!"))
+        {
+            r = !test_unary(a[1], a[2], &ok);
+        }
+        break;
+    default: ok = false;
+    }
+    if (!ok)
+    {
+        fprintf(stderr, "%s: unsupported expression\n", argv[0]);
+        return 2;
+    }
+    return (r != negate) ? 0 : 1;
+}
+
+static const struct
+{
+    const char *name;
+    int sig;
+} signal_names[] = {
+    {"HUP", SIGHUP}, {"INT", SIGINT}, {"QUIT", SIGQUIT}, {"KILL", SIGKILL},
+    {"USR1", SIGUSR1}, {"USR2", SIGUSR2}, {"PIPE", SIGPIPE}, {"ALRM", SIGALRM},
+    {"TERM", SIGTERM}, {"CHLD", SIGCHLD}, {"CONT", SIGCONT}, {"STOP", SIGSTOP},
+    {"TSTP", SIGTSTP}, {"TTIN", SIGTTIN}, {"TTOU", SIGTTOU},
+};
+
+static int signal_number(const char *s)
+{
+    if (*s >= '0' && *s <= '9')
+    {
+        return atoi(s);
+    }
+    if (!strncasecmp(s, "SIG", 3))
+    {
+        s += 3;
+    }
+    for (auto &n : signal_names)
+    {
+        if (!strcasecmp(s, n.name))
+        {
+            return n.sig;
+        }
+    }
+    return -1;
+}
+
+/* kill [-SIG | -s SIG | -l] pid|%job...; %N is the job number shown by
+ * jobs and signals its whole process group */
+static int fb_kill(int argc, char **argv, fast_out_t *out)
+{
+    int sig = SIGTERM, i = 1, rc = 0;
+    if (i < argc && !strcmp(argv[i], "-l"))
+    {
+        for (auto &n : signal_names)
+        {
+            char buf[32];
+            snprintf(buf, sizeof(buf), "%2d) SIG%s\n", n.sig, n.name);
+            out_puts(out, buf);
+        }
+        return 0;
+    }
+    if (i < argc && !strcmp(argv[i], "-s") && i + 1 < argc)
+    {
+        sig = signal_number(argv[i + 1]);
+        i += 2;
+    }
+    else if (i < argc && argv[i][0] == '-' && argv[i][1])
+    {
+        sig = signal_number(argv[i] + 1);
+        i++;
+    }
+    if (sig < 0 || i == argc)
+    {
+        fprintf(stderr, "kill: usage: kill [-s sigspec | -signum] pid | %%job ...\n");
+        return 2;
+    }
+    for (; i < argc; i++)
+    {
+        pid_t target;
+        if (argv[i][0] == '%')
+        {
+            job_t *j = jobs_find_spec(argv[i]);
+            if (j && sig && sched_cancel(j))
+            {
+                /* never started: it ends as if the signal had killed it */
+                for (process_t *p = j->first_process; p; p = p->next)
+                {
+                    p->completed = true;
+                    p->status = sig;
+                }
+                continue;
+            }
+            if (!j || j->pgid <= 0)
+            {
+                fprintf(stderr, "kill: %s: no such job\n", argv[i]);
+                rc = 1;
+                continue;
+            }
+            target = -j->pgid;
+        }
+        else
+        {
+            target = atoi(argv[i]);
+        }
+        if (target == 0 || kill(target, sig) < 0)
+        {
+            fprintf(stderr, "kill: %s: %s\n", argv[i], target ? strerror(errno) : "invalid pid");
+            rc = 1;
+        }
+    }
+    return rc;
+}
+
+static const struct
+{
+    const char *name;
+    fast_builtin_fn fn;
+    bool main_thread; /* touches shell state, so never runs on a stage thread */
+} fast_builtins[] = {
+    {"echo", fb_echo, false},
+    {"true", fb_true, false},
+    {"false", fb_false, false},
+    {"printf", fb_printf, false},
+    {"test", fb_test, false},
+    {"[", fb_test, false},
+    {"pwd", fb_pwd, false},
+    {"kill", fb_kill, true},
+};
+
+/* The in-process implementation of name, or NULL to exec it as usual */
+fast_builtin_fn fast_builtin(const char *name, bool *main_thread)
+{
+    for (auto &b : fast_builtins)
+    {
+        if (!strcmp(name, b.name))
+        {
+            if (main_thread)
+            {
+                *main_thread = b.main_thread;
+            }
+            return b.fn;
+        }
+    }
+    return NULL;
+}
+
+/* Run a fast builtin to completion; the output is flushed to out->fd when it
+ * has one and stays in out->buf otherwise.  Returns a waitpid()-style status. */
+int run_fast_builtin(fast_builtin_fn fn, int argc, char **argv, fast_out_t *out)
+{
+    int rc = fn(argc, argv, out);
+    out_flush(out);
+    if (out->fd >= 0 && out->owns_fd)
+    {
+        close(out->fd);
+        out->fd = -1;
+    }
+    return (rc & 0xff) << 8;
+}
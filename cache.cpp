@@ -0,0 +1,200 @@
+#include "dsh.h"
+#include <list>
+#include <string>
+#include <unordered_map>
+
+using namespace std;
+
+/* Parsed-job cache.  Interactive scripts and for loops hand readcommandline()
+ * the same expanded lines over and over; instead of lexing them again, the
+ * first parse is kept as an immutable template and every later request gets
+ * a clone of it.  A clone is one memcpy of the line plus copies of the job
+ * and process structs, with the pointers rebased onto the new text.  The
+ * warnings of the first parse are kept too and printed again on each hit,
+ * as a parse of its own would. */
+
+struct cache_entry
+{
+    string line;    /* expanded command line, also the text length */
+    job_t *tmpl;    /* parsed jobs; argv is never built on a template */
+    string warnings;    /* what the parse printed though it succeeded */
+};
+
+static list<cache_entry> lru;   /* most recently used first */
+static unordered_map<string, list<cache_entry>::iterator> index_by_line;
+
+static unsigned long cache_hits = 0;
+static unsigned long cache_misses = 0;
+
+static void free_template(job_t *j)
+{
+    while (j)
+    {
+        job_t *next = j->next;
+        free_job(j);
+        j = next;
+    }
+}
+
+job_t *clone_jobs(const job_t *first_job, size_t text_len)
+{
+    size_t bytes = text_len + 1 + 256;
+    for (const job_t *j = first_job; j; j = j->next)
+    {
+        bytes += sizeof(job_t);
+        for (const process_t *p = j->first_process; p; p = p->next)
+        {
+            bytes += sizeof(process_t) + (p->argc > INLINE_ARGS ? p->words_cap * sizeof(span_t) : 0);
+            bytes += (p->ifile ? strlen(p->ifile) + 1 : 0) + (p->ofile ? strlen(p->ofile) + 1 : 0);
+        }
+    }
+
+    arena_t *arena = arena_create(bytes);
+    if (!arena)
+    {
+        return NULL;
+    }
+
+    /* the template text holds the NULs that end each commandinfo, so it is
+     * copied as raw bytes and not as a string */
+    const char *old_text = first_job->first_process ? first_job->first_process->text : NULL;
+    char *text = NULL;
+    if (old_text)
+    {
+        if (!(text = (char *)arena_alloc(arena, text_len + 1)))
+        {
+            arena_destroy(arena);
+            return NULL;
+        }
+        memcpy(text, old_text, text_len + 1);
+    }
+
+    job_t *first = NULL, *last = NULL;
+    for (const job_t *j = first_job; j; j = j->next)
+    {
+        job_t *nj = (job_t *)arena_alloc(arena, sizeof(job_t));
+        if (!nj)
+        {
+            arena_destroy(arena);
+            return NULL;
+        }
+        *nj = *j;
+        nj->next = NULL;
+        nj->first_process = NULL;
+        nj->arena = arena;
+        arena_retain(arena);
+        if (old_text)
+        {
+            nj->commandinfo = text + (j->commandinfo - old_text);
+        }
+        else
+        {
+            nj->commandinfo = arena_strndup(arena, j->commandinfo, strlen(j->commandinfo));
+        }
+
+        process_t *plast = NULL;
+        for (const process_t *p = j->first_process; p; p = p->next)
+        {
+            process_t *np = (process_t *)arena_alloc(arena, sizeof(process_t));
+            if (!np || !init_process(np, arena))
+            {
+                arena_destroy(arena);
+                return NULL;
+            }
+            np->text = text;
+            if (p->words_cap > np->words_cap)
+            {
+                if (!(np->words = (span_t *)arena_alloc(arena, p->words_cap * sizeof(span_t))))
+                {
+                    arena_destroy(arena);
+                    return NULL;
+                }
+                np->words_cap = p->words_cap;
+            }
+            memcpy(np->words, p->words, p->argc * sizeof(span_t));
+            np->argc = p->argc;
+            np->arg_bytes = p->arg_bytes;
+            if (p->ifile)
+            {
+                np->ifile = arena_strndup(arena, p->ifile, strlen(p->ifile));
+            }
+            if (p->ofile)
+            {
+                np->ofile = arena_strndup(arena, p->ofile, strlen(p->ofile));
+            }
+            if (plast)
+            {
+                plast->next = np;
+            }
+            else
+            {
+                nj->first_process = np;
+            }
+            plast = np;
+        }
+
+        if (last)
+        {
+            last->next = nj;
+        }
+        else
+        {
+            first = nj;
+        }
+        last = nj;
+    }
+    return first;
+}
+
+job_t *readcommandline(const char *cmdline)
+{
+    string line(cmdline);
+    auto it = index_by_line.find(line);
+    if (it != index_by_line.end())
+    {
+        cache_hits++;
+        lru.splice(lru.begin(), lru, it->second);
+        parse_report(it->second->warnings);
+        return clone_jobs(it->second->tmpl, line.size());
+    }
+
+    cache_misses++;
+    string warnings;
+    string *outer = parse_messages;
+    parse_messages = &warnings;
+    job_t *tmpl = parse_commandline(cmdline, line.size());
+    parse_messages = outer;
+    parse_report(warnings);
+    if (!tmpl)
+    {
+        return NULL; /* errors are not cached, they get reported every time */
+    }
+
+    if (lru.size() >= PARSE_CACHE_SIZE)
+    {
+        free_template(lru.back().tmpl);
+        index_by_line.erase(lru.back().line);
+        lru.pop_back();
+    }
+    lru.push_front(cache_entry{line, tmpl, warnings});
+    index_by_line[line] = lru.begin();
+    return clone_jobs(tmpl, line.size());
+}
+
+void parse_cache_stats(unsigned long *hits, unsigned long *misses, unsigned *entries)
+{
+    *hits = cache_hits;
+    *misses = cache_misses;
+    *entries = lru.size();
+}
+
+void parse_cache_clear()
+{
+    for (auto &e : lru)
+    {
+        free_template(e.tmpl);
+    }
+    lru.clear();
+    index_by_line.clear();
+    cache_hits = cache_misses = 0;
+}
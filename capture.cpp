@@ -0,0 +1,394 @@
+#include "dsh.h"
+#include <sys/epoll.h>
+#include <sys/ioctl.h>
+#include <mutex>
+#include <string>
+#include <thread>
+
+using namespace std;
+
+/* Output capture.  The last process of a job writes its stdout into a pipe
+ * instead of logs/<pid>.log; one capture thread waits on all those pipes with
+ * epoll and appends whatever arrives to the job's ring.  A ring holds at most
+ * CAPTURE_RING_SIZE bytes: once it is full the oldest output is overwritten,
+ * so a chatty background job costs bounded memory and never blocks on a full
+ * pipe.  peek shows what a background job has written so far.
+ *
+ * A foreground job's capture is live: the thread also relays every chunk to
+ * dsh's stdout as it arrives.  tee() duplicates the chunk into the relay pipe
+ * without consuming it and splice() moves it on to stdout, so the terminal
+ * copy never enters user space; only the read into the ring does.  When
+ * stdout cannot take a splice (a terminal on most kernels) the chunk read for
+ * the ring is written out instead.
+ *
+ * A job is done when its processes are, not when its pipe hits end of file:
+ * something it left running in the background may hold the pipe open for
+ * as long as it likes.  dsh then drains what is already in the pipe itself,
+ * without blocking, and the thread keeps whatever comes later. */
+
+#define CAPTURE_READ 65536
+
+#ifndef SPLICE_F_MOVE
+#define SPLICE_F_MOVE 1
+#endif
+#ifndef SPLICE_F_NONBLOCK
+#define SPLICE_F_NONBLOCK 2
+#endif
+
+struct capture
+{
+    mutex lock;
+    mutex reading;          /* held around each read and its append, so
+                             * capture_drain() cannot reorder chunks */
+    int fd;                 /* read end, owned by the capture thread */
+    string ring;            /* grows up to CAPTURE_RING_SIZE, then wraps */
+    size_t head;            /* oldest byte once the ring has wrapped */
+    size_t total;           /* bytes ever written by the job */
+    bool eof;
+    bool live;              /* relay to stdout too: the job is in the foreground */
+    bool relayed;           /* some output already went to stdout */
+    int refs;               /* the job and, until eof, the capture thread */
+};
+
+static int capture_epoll = -1;
+static once_flag capture_started;
+static int relay[2] = {-1, -1};    /* tee() target on the way to stdout */
+static bool relay_splice = true;   /* stdout accepts splice() */
+
+static void capture_unref(capture_t *c)
+{
+    unique_lock<mutex> guard(c->lock);
+    if (--c->refs == 0)
+    {
+        guard.unlock();
+        delete c;
+    }
+}
+
+static void capture_append(capture_t *c, const char *data, size_t len)
+{
+    lock_guard<mutex> guard(c->lock);
+    c->total += len;
+    c->relayed = c->relayed || c->live;
+    if (len >= CAPTURE_RING_SIZE)
+    {
+        /* only the tail of a huge read survives anyway */
+        c->ring.assign(data + len - CAPTURE_RING_SIZE, CAPTURE_RING_SIZE);
+        c->head = 0;
+        return;
+    }
+    size_t room = CAPTURE_RING_SIZE - c->ring.size();
+    if (room)
+    {
+        size_t n = len < room ? len : room;
+        c->ring.append(data, n);
+        data += n;
+        len -= n;
+    }
+    while (len)
+    {
+        size_t n = CAPTURE_RING_SIZE - c->head;
+        n = len < n ? len : n;
+        memcpy(&c->ring[c->head], data, n);
+        c->head = (c->head + n) % CAPTURE_RING_SIZE;
+        data += n;
+        len -= n;
+    }
+}
+
+static void write_stdout(const char *data, size_t len)
+{
+    while (len)
+    {
+        ssize_t n = write(STDOUT_FILENO, data, len);
+        if (n < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        if (n <= 0)
+        {
+            return;
+        }
+        data += n;
+        len -= n;
+    }
+}
+
+/* Move len bytes sitting in the relay pipe to stdout.  false when stdout
+ * refused the splice before anything moved; the bytes are dropped from the
+ * relay and the caller writes its own copy. */
+static bool relay_out(size_t len)
+{
+    static char scratch[CAPTURE_READ];
+    bool moved = false;
+    while (len)
+    {
+        ssize_t n = splice(relay[0], NULL, STDOUT_FILENO, NULL, len, SPLICE_F_MOVE);
+        if (n < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        if (n <= 0)
+        {
+            /* whatever is left is the only copy of it: drain it by hand */
+            while (len)
+            {
+                ssize_t r = read(relay[0], scratch, len < sizeof(scratch) ? len : sizeof(scratch));
+                if (r <= 0)
+                {
+                    break;
+                }
+                if (moved)
+                {
+                    write_stdout(scratch, r);
+                }
+                len -= r;
+            }
+            return moved;
+        }
+        moved = true;
+        len -= n;
+    }
+    return true;
+}
+
+/* Read the next chunk of c's pipe into its ring, relaying it to stdout when
+ * c is live.  Returns what read() returned. */
+static ssize_t capture_chunk(capture_t *c, char *buf)
+{
+    bool live;
+    {
+        lock_guard<mutex> guard(c->lock);
+        live = c->live;
+    }
+    if (!live)
+    {
+        return read(c->fd, buf, CAPTURE_READ);
+    }
+
+    if (relay_splice && relay[0] >= 0)
+    {
+        ssize_t n = tee(c->fd, relay[1], CAPTURE_READ, SPLICE_F_NONBLOCK);
+        if (n > 0)
+        {
+            if (!relay_out(n))
+            {
+                relay_splice = false;
+            }
+            else
+            {
+                /* the same n bytes are still in c's pipe */
+                size_t got = 0;
+                while (got < (size_t)n)
+                {
+                    ssize_t r = read(c->fd, buf + got, n - got);
+                    if (r < 0 && errno == EINTR)
+                    {
+                        continue;
+                    }
+                    if (r <= 0)
+                    {
+                        break;
+                    }
+                    got += r;
+                }
+                return got;
+            }
+        }
+        else if (n < 0 && errno == EINVAL)
+        {
+            relay_splice = false;
+        }
+        else if (n < 0 && (errno == EINTR || errno == EAGAIN))
+        {
+            return -1;
+        }
+        /* n == 0 is end of file: the read below sees it too */
+    }
+
+    ssize_t got = read(c->fd, buf, CAPTURE_READ);
+    if (got > 0)
+    {
+        write_stdout(buf, got);
+    }
+    return got;
+}
+
+static void capture_loop()
+{
+    static char buf[CAPTURE_READ];
+    struct epoll_event events[16];
+    while (1)
+    {
+        int n = epoll_wait(capture_epoll, events, 16, -1);
+        for (int i = 0; i < n; i++)
+        {
+            capture_t *c = (capture_t *)events[i].data.ptr;
+            unique_lock<mutex> reading(c->reading);
+            ssize_t got = capture_chunk(c, buf);
+            if (got > 0)
+            {
+                capture_append(c, buf, got);
+                continue;
+            }
+            if (got < 0 && (errno == EINTR || errno == EAGAIN))
+            {
+                continue; /* capture_drain() got there first */
+            }
+            /* every writer is gone */
+            epoll_ctl(capture_epoll, EPOLL_CTL_DEL, c->fd, NULL);
+            close(c->fd);
+            {
+                lock_guard<mutex> guard(c->lock);
+                c->fd = -1;
+                c->eof = true;
+            }
+            reading.unlock();
+            capture_unref(c);
+        }
+    }
+}
+
+static void capture_start()
+{
+    capture_epoll = epoll_create1(EPOLL_CLOEXEC);
+    if (pipe2(relay, O_CLOEXEC) < 0)
+    {
+        relay[0] = relay[1] = -1;
+    }
+    if (capture_epoll >= 0)
+    {
+        thread(capture_loop).detach();
+    }
+}
+
+/* New capture; *write_fd gets the O_CLOEXEC write end to hand to the child.
+ * A live capture also streams to stdout.  NULL when no pipe could be set up. */
+capture_t *capture_open(int *write_fd, bool live)
+{
+    call_once(capture_started, capture_start);
+    int fds[2];
+    if (capture_epoll < 0 || pipe2(fds, O_CLOEXEC) < 0)
+    {
+        return NULL;
+    }
+    /* non-blocking: capture_drain() may empty it between the wakeup and the
+     * thread's read */
+    fcntl(fds[0], F_SETFL, O_NONBLOCK);
+    capture_t *c = new capture();
+    c->fd = fds[0];
+    c->head = 0;
+    c->total = 0;
+    c->eof = false;
+    c->live = live;
+    c->relayed = false;
+    c->refs = 2;
+
+    struct epoll_event ev;
+    ev.events = EPOLLIN;
+    ev.data.ptr = c;
+    if (epoll_ctl(capture_epoll, EPOLL_CTL_ADD, c->fd, &ev) < 0)
+    {
+        close(fds[0]);
+        close(fds[1]);
+        delete c;
+        return NULL;
+    }
+    *write_fd = fds[1];
+    return c;
+}
+
+/* In a forked worker: the capture thread stayed behind in dsh, so the
+ * worker's jobs write straight to its stdout */
+void capture_fork_child()
+{
+    if (capture_epoll >= 0)
+    {
+        close(capture_epoll);
+        capture_epoll = -1;
+    }
+}
+
+/* The job lets go of its capture; the ring goes once the pipe is drained */
+void capture_release(capture_t *c)
+{
+    if (c)
+    {
+        capture_unref(c);
+    }
+}
+
+/* Take into the ring, and relay when c is live, whatever is in the pipe
+ * right now; never waits for more.  Once a job's processes have exited this
+ * is everything they wrote. */
+void capture_drain(capture_t *c)
+{
+    static char buf[CAPTURE_READ];
+    lock_guard<mutex> reading(c->reading);
+    bool live;
+    {
+        lock_guard<mutex> guard(c->lock);
+        if (c->eof)
+        {
+            return;
+        }
+        live = c->live;
+    }
+    int avail;
+    while (ioctl(c->fd, FIONREAD, &avail) == 0 && avail > 0)
+    {
+        /* we are the only reader while reading is held: this cannot block */
+        ssize_t got = read(c->fd, buf, (size_t)avail < sizeof(buf) ? (size_t)avail : sizeof(buf));
+        if (got < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        if (got <= 0)
+        {
+            break;
+        }
+        if (live)
+        {
+            write_stdout(buf, got);
+        }
+        capture_append(c, buf, got);
+    }
+}
+
+/* What the ring holds, oldest byte first; *dropped gets how many bytes
+ * were overwritten before they could be read */
+string capture_contents(capture_t *c, size_t *dropped)
+{
+    lock_guard<mutex> guard(c->lock);
+    if (dropped)
+    {
+        *dropped = c->total - c->ring.size();
+    }
+    if (c->head == 0)
+    {
+        return c->ring;
+    }
+    return c->ring.substr(c->head) + c->ring.substr(0, c->head);
+}
+
+/* Start or stop streaming c to stdout, as its job moves to the foreground
+ * or back */
+void capture_set_live(capture_t *c, bool live)
+{
+    lock_guard<mutex> guard(c->lock);
+    c->live = live;
+}
+
+/* True if any of c's output was streamed to stdout */
+bool capture_relayed(capture_t *c)
+{
+    lock_guard<mutex> guard(c->lock);
+    return c->relayed;
+}
+
+/* True once every writer has closed the pipe */
+bool capture_done(capture_t *c)
+{
+    lock_guard<mutex> guard(c->lock);
+    return c->eof;
+}
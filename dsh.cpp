@@ -6,146 +6,326 @@
 #include <sstream>
 #include <algorithm>
 #include <vector>
+#include <thread>
 #include <stdarg.h>
-#include <fstream>
 #include <stdio.h>
 #include <stdlib.h>
 
 using namespace std;
 static char prompt_head[20];
-static const char *history[100];
-unsigned history_count = 0;
 
 unordered_map<string, int> intVariables;
 unordered_map<string, string> strVariables;
 
 job_t *job_list = NULL; // first job
-bool assigncmd = false;
+extern int dsh_is_interactive;
+string *subst_output = NULL;  // where the $(...) being run collects its output
+size_t subst_max = SUBST_MAX;
 
 static const int PIPE_READ = 0;
 static const int PIPE_WRITE = 1;
 
 // helper functions
-job_t *search_job(int jid);
-job_t *search_job_pos(int pos);
-void addJob(job_t *j);                                    // add job to job list
-process_t *getProcess(int pid);                           // get the process by process id
-void redirect(process_t *p);                              // redirect the input/output
-int set_pgid(job_t *j, process_t *p);                     // set pgid for a job
-void new_child(job_t *j, process_t *p, bool fg);          // create context for new child process
 void continue_job(job_t *j);                              // continue a stopped job
 char *promptmsg();                                        // heading
-int parent_wait(job_t *j, int fg);                       // parent wait for child to finish
-void print_jobs();                                        // print jobs in the list
+int parent_wait(job_t *j, int fg, int read_fd = -1,      // parent wait for child to finish
+                void (*sink)(const char *, size_t) = NULL);
+void print_jobs(bool verbose);                            // print jobs in the list
 bool builtin_cmd(job_t *last_job, int argc, char **argv); // execute built-in cmd
 void spawn_job(job_t *j, bool fg);                        // spawn a new job
+void report_output(job_t *j, process_t *p);               // show and log a foreground job's output
 
 void print(string cmdline);
 void assignment(string cmdline);
+bool read_shell_line(string &line);
 int *getForLoop(string cmdline);
 void add_command_to_history(const char *command);
-void log_output(char *output);
 
 bool interactive_shell;
 int calculate(string cmdline);
 bool isArithmetic(string cmdline);
 
-bool free_job(job_t *j);
+void run_jobs(job_t *j, bool record_history);
 
-void remove_finished_jobs() {
-    job_t *job = job_list;
-    job_t *prev_job = NULL;
-    while (job != NULL) {
-        if (job_is_completed(job)) {
-            if (job == job_list) {
-//                if(!free_job(job))
-                job_list = job_list -> next;
-                free_job(job);
-                job = job_list;
-            } else {
-                prev_job -> next = job -> next;
-                free(job);
-                job = prev_job -> next;
-            }
+/* A finished background job's captured output used to stay behind in
+ * logs/<pid>.log; it goes to output.log before the job is dropped */
+static void log_captured_output(job_t *job)
+{
+    if (!job->bg || !job->capture)
+    {
+        return;
+    }
+    capture_drain(job->capture);
+    size_t dropped;
+    string out = capture_contents(job->capture, &dropped);
+    if (out.empty())
+    {
+        return;
+    }
+    char head[1024];
+    snprintf(head, sizeof(head), "#Output of background job '%s'", job->commandinfo);
+    if (dropped)
+    {
+        snprintf(head + strlen(head), sizeof(head) - strlen(head), " (%zu bytes dropped)", dropped);
+    }
+    out = string(head) + "\n" + out + "~";
+    log_output(&out[0]);
+}
 
+/* time cmd ...: print and log the totals of a finished job */
+static void report_time(job_t *j)
+{
+    if (!j->timed)
+    {
+        return;
+    }
+    string out = usage_time_report(j);
+    printf("%s", out.c_str());
+    fflush(stdout);
+    out += "~";
+    log_output(&out[0]);
+}
+
+/* The limit that killed a process of the finished job j, or empty */
+static string job_limit(job_t *j)
+{
+    for (process_t *p = j->first_process; p; p = p->next)
+    {
+        string limit = limits_exceeded(j, p);
+        if (!limit.empty())
+        {
+            return limit;
+        }
+    }
+    return "";
+}
+
+/* How the finished job j ended, as jobs and the Done notices put it:
+ * "Done", "Exit N", the signal that killed it, or the limit that did */
+static string job_state(job_t *j)
+{
+    process_t *last = j->first_process;
+    while (last && last->next)
+    {
+        last = last->next;
+    }
+    string limit = job_limit(j);
+    if (!limit.empty())
+    {
+        return "Killed: " + limit;
+    }
+    char state[64] = "Done";
+    if (last && last->status != -1)
+    {
+        if (WIFEXITED(last->status) && WEXITSTATUS(last->status))
+        {
+            snprintf(state, sizeof(state), "Exit %d", WEXITSTATUS(last->status));
         }
-        else {
-            prev_job = job;
-            job = job -> next;
+        else if (WIFSIGNALED(last->status))
+        {
+            snprintf(state, sizeof(state), "%s", strsignal(WTERMSIG(last->status)));
         }
     }
+    return state;
 }
 
-job_t *search_job(int jid)
+/* bash-style "[N]+  Done  cmd" line for a finished background job */
+static void notify_done(job_t *job)
 {
-    job_t *job = job_list;
-    while (job != NULL)
+    string state = job_state(job);
+    if (state.size() < 24)
     {
-        if (job->pgid == jid)
-            return job;
-        job = job->next;
+        state.append(24 - state.size(), ' ');
     }
-    return NULL;
+    string log = "[" + to_string(job->id) + "]+  " + state + job->commandinfo + "\n";
+    printf("%s", log.c_str());
+    log += "~";
+    log_output(&log[0]);
 }
 
-job_t *search_job_pos(int pos)
+/* A foreground process killed by one of its job's limits says so; any
+ * other signal that killed a process of a limited job is named as it is */
+static void report_limits(job_t *j)
 {
-    job_t *job = job_list;
-    int count = pos;
-    while (job != NULL)
+    if (!j->limit_mask)
+    {
+        return;
+    }
+    for (process_t *p = j->first_process; p; p = p->next)
     {
-        if (count == 1)
+        string limit = limits_exceeded(j, p);
+        if (limit.empty() && p->completed && p->pid > 0 && WIFSIGNALED(p->status))
         {
-//            printf("job find\n");
-            return job;
+            limit = strsignal(WTERMSIG(p->status));
         }
-        if (job->next == NULL)
+        if (limit.empty())
         {
-            return job;
+            continue;
+        }
+        string log = string("dsh: ") + p->argv[0] + ": " + limit + "\n";
+        fprintf(stderr, "%s", log.c_str());
+        log += "~";
+        log_output(&log[0]);
+    }
+}
+
+/* Drop every finished job; notify: with the Done notices of background jobs */
+static void prune_jobs(bool notify)
+{
+    /* exits the reaper thread has collected since last time */
+    reaper_collect(jobs_find_pid);
+    if (!reaper_active())
+    {
+        poll_jobs(job_list);
+    }
+    job_t *job = job_list;
+    while (job != NULL) {
+        job_t *next = job->next;
+        if (job_is_completed(job)) {
+            if (job->bg && notify && !dsh_is_interactive && !job_limit(job).empty())
+            {
+                /* no Done notice without a terminal: jobs reports it */
+                job = next;
+                continue;
+            }
+            if (!job->bg)
+            {
+                report_limits(job);
+            }
+            else if (notify && dsh_is_interactive)
+            {
+                notify_done(job);
+            }
+            log_captured_output(job);
+            report_time(job);
+            sched_forget(job);
+            jobs_remove(job);
+            free_job(job);
         }
-        count--;
-        job = job->next;
+        job = next;
     }
-    return NULL;
+    sched_dispatch(); /* whatever finished made room for queued jobs */
+}
+
+void remove_finished_jobs() {
+    prune_jobs(true);
 }
 
-void addJob(job_t *j)
+/* Prefixes that set up a job rather than name its command: "prio N cmd"
+ * queues the background job cmd with priority N, "time cmd" reports the
+ * job's resource usage once it is done, "limit k=v ... -- cmd" sets
+ * resource limits for its processes, and "run --cpus 4-7 --nice 10 cmd"
+ * places them.  The prefix words are dropped from
+ * the job's first process.  False, after saying why, when a prefix is
+ * malformed and the job must not run. */
+static bool job_prefix(job_t *j, process_t *p)
 {
-    if (j)
+    while (p->argv)
     {
-        if (job_list == NULL)
+        if (p->argc >= 3 && !strcmp(p->argv[0], "prio"))
         {
-            job_list = j;
+            j->priority = atoi(p->argv[1]);
+            p->argv += 2;
+            p->argc -= 2;
         }
-        else
+        else if (p->argc >= 2 && !strcmp(p->argv[0], "time"))
+        {
+            j->timed = true;
+            p->argv += 1;
+            p->argc -= 1;
+        }
+        else if (!strcmp(p->argv[0], "run"))
         {
-            job_t *cur = job_list;
-            while (cur->next != NULL)
+            int i = 1;
+            int used;
+            while ((used = place_option(&j->place, p->argc - i, p->argv + i)) > 0)
+            {
+                i += used;
+            }
+            if (used == 0 && i < p->argc && !strcmp(p->argv[i], "--"))
+            {
+                i++;
+            }
+            if (used < 0 || i >= p->argc || !strncmp(p->argv[i], "--", 2))
+            {
+                const char *bad = used < 0 ? p->argv[i + 1] : i < p->argc ? p->argv[i] : "missing cmd";
+                string log = string("run: ") + bad + ": expected [--cpus LIST] [--nice N] [--io CLASS[:LEVEL]] cmd\n";
+                fprintf(stderr, "%s", log.c_str());
+                log += "~";
+                log_output(&log[0]);
+                return false;
+            }
+            p->argv += i;
+            p->argc -= i;
+        }
+        else if (!strcmp(p->argv[0], "limit"))
+        {
+            int i = 1;
+            while (i < p->argc && strcmp(p->argv[i], "--") && limits_set(j, p->argv[i]))
+            {
+                i++;
+            }
+            if (i + 1 >= p->argc || strcmp(p->argv[i], "--"))
             {
-                cur = cur->next;
+                const char *bad = i < p->argc ? p->argv[i] : "missing -- cmd";
+                string log = string("limit: ") + bad + ": expected name=value ... -- cmd\n";
+                fprintf(stderr, "%s", log.c_str());
+                log += "~";
+                log_output(&log[0]);
+                return false;
             }
-            cur->next = j;
+            p->argv += i + 1;
+            p->argc -= i + 1;
+        }
+        else
+        {
+            break;
         }
     }
+    return true;
 }
 
-process_t *getProcess(int pid)
+/* Run every job parsed from one command line.  Each job is unlinked from
+ * its siblings first since spawn_job() appends it to job_list on its own.
+ * Jobs handled as builtins, or refused over a bad prefix, never enter
+ * job_list and are released here, and a finished foreground job is dropped
+ * as soon as it has been recorded, so the line's arena is recycled without waiting for the next `jobs`. */
+void run_jobs(job_t *j, bool record_history)
 {
-    job_t *cur = job_list;
-    while (cur)
+    while (j)
     {
-        process_t *p = cur->first_process;
-        while (p)
+        job_t *next = j->next;
+        j->next = NULL;
+
+        char **argv = process_argv(j, j->first_process);
+        bool runnable = !argv || job_prefix(j, j->first_process);
+        argv = j->first_process->argv;
+        int argc = j->first_process->argc;
+        bool handled = !runnable || (argv && builtin_cmd(j, argc, argv));
+        if (!handled)
+        {
+            spawn_job(j, !(j->bg));
+        }
+        if (record_history && j->commandinfo)
         {
-            if (p->pid == pid)
+            char *line = strtok(j->commandinfo, "\n");
+            string name = line ? line : "";
+            if (j->bg)
             {
-                return p;
+                name += "&";
             }
-            p = p->next;
+            add_command_to_history(name.c_str());
         }
-        cur = cur->next;
+        if (handled)
+        {
+            free_job(j);
+        }
+        else if (job_is_completed(j))
+        {
+            remove_finished_jobs();
+        }
+        j = next;
     }
-    return NULL;
 }
 
 void redirect(process_t *p)
@@ -201,11 +381,14 @@ void new_child(job_t *j, process_t *p, bool fg)
 
     /* Set the handling for job control signals back to the default. */
     signal(SIGINT, SIG_DFL);
+    signal(SIGPIPE, SIG_DFL);
+    events_child();
+    place_apply(&j->place, 0);
 }
 
 void continue_job(job_t *j)
 {
-    process_t *main_process = getProcess(j->pgid);
+    process_t *main_process = jobs_find_pid(j->pgid);
     process_t *p = main_process;
     while (p)
     {
@@ -229,53 +412,28 @@ char *promptmsg()
     return prompt_head;
 }
 
-int parent_wait(job_t *j, int fg)
+/* Wait for the foreground job j to complete or stop (see wait_job()) and
+ * take the terminal back; what it writes to read_fd meanwhile goes to sink */
+int parent_wait(job_t *j, int fg, int read_fd, void (*sink)(const char *, size_t))
 {
     if (fg)
     {
-        int status, pid;
-        while ((pid = waitpid(WAIT_ANY, &status, WUNTRACED)) > 0)
+        pid_t pid = wait_job(j, job_list, read_fd, sink);
+        if (isatty(STDIN_FILENO))
         {
-            process_t *p = getProcess(pid);
-            if (WIFEXITED(status))
-            {
-                p->completed = true;
-            }
-            else if (WIFSTOPPED(status))
-            {
-                if (kill(-j->pgid, SIGSTOP) < 0)
-                {
-                    printf("Kill SIGSTOP failed");
-                }
-                p->stopped = true;
-                j->notified = true;
-                j->bg = true;
-                print_jobs();
-            }
-
-            else if (WIFCONTINUED(status))
-            {
-                p->stopped = 0;
-            }
-            else if (WIFSIGNALED(status))
-            {
-                p->completed = 1;
-            }
-            if (job_is_stopped(j) && isatty(STDIN_FILENO))
-            {
-                seize_tty(getpid());
-                break;
-            }
+            seize_tty(getpid());
         }
         return pid;
     }
     return -1;
 }
 
-void print_jobs()
+/* The job list; verbose adds each process's resource usage (jobs -v).
+ * Finished jobs are listed once, with how they ended, and then dropped. */
+void print_jobs(bool verbose)
 {
-    int count = 1;
-    remove_finished_jobs();
+    poll_jobs(job_list); /* stops are not the reaper's business */
+    reaper_collect(jobs_find_pid);
     job_t *j = job_list;
 
     if (j == NULL)
@@ -284,40 +442,69 @@ void print_jobs()
     }
     while (j != NULL)
     {
-        printf("[%d]", count);
-        if (j->notified)
+        printf("[%d]", j->id);
+        if (job_is_completed(j))
+        {
+            string state = job_state(j);
+            printf(" %s  %-14s ", j->bg ? "bg" : "fg", state.c_str());
+            string log = "[" + to_string(j->id) + "] " + (j->bg ? "bg" : "fg") + "  " + state;
+            if (state.size() < 14)
+            {
+                log.append(14 - state.size(), ' ');
+            }
+            log = log + " " + j->commandinfo + "\n~";
+            log_output(&log[0]);
+        }
+        else if (j->queued)
+        {
+            printf(" bg  Queued         ");
+            string log = "[" + to_string(j->id) + "] bg  Queued         " + j->commandinfo + "\n~";
+            log_output(&log[0]);
+        }
+        else if (j->notified)
         {
             printf("    Stopped     ");
-            char log[1024];
-            char *target = log;
-            target += sprintf(target, "[%d]    Stopped     \n~", count);
-            log_output(log);
+            string log = "[" + to_string(j->id) + "]    Stopped     \n~";
+            log_output(&log[0]);
         }
         else
         {
-            char log[1024];
-            char *target = log;
-            if (j->bg)
-            {
-                printf(" bg ");
-                sprintf(target, " bg  Running        %s\n", j->commandinfo);
-                strcat(log, "~");
-                log_output(log);
-            }
-            else
-            {
-                printf(" fg ");
-                sprintf(target, " fg  Running        %s\n", j->commandinfo);
-                strcat(log, "~");
-                log_output(log);
-            }
+            string log = string(j->bg ? " bg" : " fg") + "  Running        " + j->commandinfo + "\n~";
+            printf(j->bg ? " bg " : " fg ");
+            log_output(&log[0]);
             printf(" Running        ");
         }
         printf("%s\n", j->commandinfo);
+        if (verbose && !j->queued)
+        {
+            string usage = usage_lines(j);
+            printf("%s", usage.c_str());
+            usage += "~";
+            log_output(&usage[0]);
+        }
         j = j->next;
-        count++;
     }
     fflush(stdout);
+    prune_jobs(false);
+}
+
+/* history -a: the lines of the history file past skip, numbered */
+struct hist_listing
+{
+    size_t skip;
+    string out;
+};
+
+static void list_history_line(size_t n, const char *line, void *arg)
+{
+    hist_listing *listing = (hist_listing *)arg;
+    if (n <= listing->skip)
+    {
+        return;
+    }
+    char num[32];
+    snprintf(num, sizeof(num), "%zu: ", n);
+    listing->out += string(num) + line + "\n";
 }
 
 bool builtin_cmd(job_t *last_job, int argc, char **argv)
@@ -333,70 +520,62 @@ bool builtin_cmd(job_t *last_job, int argc, char **argv)
     }
     else if (!strcmp("jobs", argv[0]))
     {
-        print_jobs();
+        print_jobs(argc == 2 && !strcmp(argv[1], "-v"));
         return true;
     }
     else if (!strcmp("history", argv[0]) && !interactive_shell)
     {
-        if (argc == 1)
+        if (argc == 1 && hist_lines() == 0)
         {
-            char buffer[1024];
-            char *target = buffer;
-            if (history_count == 0)
-            {
-                printf("No commands ever ran in this session.");
-                strcat(buffer, "No commands ever ran in this session.\n~");
-                log_output(buffer);
-                return true;
-            }
-            for (int i = 0; i < history_count; i++)
+            printf("No commands ever ran in this session.");
+            log_output("No commands ever ran in this session.\n~");
+            return true;
+        }
+        else if (argc >= 3 && !strcmp(argv[1], "-s"))
+        {
+            //history -s PATTERN: past command lines and outputs holding it
+            string pattern = argv[2];
+            for (int i = 3; i < argc; i++)
             {
-                printf("%d: %s\n", i + 1, history[i]);
-                target += sprintf(target, "%d: %s\n", i + 1, history[i]);
+                pattern += string(" ") + argv[i];
             }
-            target += sprintf(target, "~");
-            log_output(buffer);
+            string out = history_search(pattern);
+            printf("%s", out.c_str());
+            history_search_logged(log_entries_end());
+            out += "~";
+            log_output(&out[0]);
+            return true;
+        }
+        else if (argc == 1 || (argc <= 3 && !strcmp(argv[1], "-a")))
+        {
+            //every session's commands from the history file, each once;
+            //history -a N lists the last N
+            size_t lines = hist_lines();
+            size_t last = argc == 3 ? strtoul(argv[2], NULL, 10) : lines;
+            hist_listing listing = {lines > last ? lines - last : 0, ""};
+            hist_foreach(list_history_line, &listing);
+            printf("%s", listing.out.c_str());
+            listing.out += "~";
+            log_output(&listing.out[0]);
             return true;
         }
         else if (argc == 2)
         {
             int index = atoi(argv[1]); // unsafe
-            FILE *fp = fopen("output.log", "r+");
-            fseek(fp, 0L, SEEK_END);
-            int lSize = ftell(fp);
-            rewind(fp);
-
-            char *buffer = (char *)calloc(1, lSize + 1);
-
-            if (1 != fread(buffer, lSize, 1, fp))
-            {
-                fclose(fp), free(buffer), fputs("entire read fails", stderr), exit(1);
-            }
-            char *o = strtok(buffer, "~");
-            int count = 1;
-            while (count < index)
-            {
-                o = strtok(NULL, "~");
-                //printf("count: %d, o: %s\n", count, o);
-                count++;
-            }
-            char *oo = strtok(o, "\n");
-            char output_buffer[1024] = {0};
-            strcat(output_buffer, "Output:\n");
-            printf("%s\n", output_buffer);
+            string entry;
+            log_entry_text(index, &entry);
+            char *oo = strtok(&entry[0], "\n");
+            string output_buffer = "Output:\n";
+            printf("%s\n", output_buffer.c_str());
 
             while (oo != NULL)
             {
                 printf("\t%s\n", oo);
-                strcat(output_buffer, "\t");
-                strcat(output_buffer, oo);
-                strcat(output_buffer, "\n");
+                output_buffer = output_buffer + "\t" + oo + "\n";
                 oo = strtok(NULL, "\n");
             }
-            fclose(fp);
-            free(buffer);
-            strcat(output_buffer, "~\n");
-            log_output(output_buffer);
+            output_buffer += "~\n";
+            log_output(&output_buffer[0]);
             return true;
         }
     }
@@ -418,16 +597,15 @@ bool builtin_cmd(job_t *last_job, int argc, char **argv)
     else if (!strcmp("bg", argv[0]))
     {
         remove_finished_jobs();
-        int position = 0;
         job_t *job;
-        if (argc != 2 || !(position = atoi(argv[1])))
+        if (argc != 2)
         {
 //            printf("%d %d", position, argc);
             printf("Error: invalid arguments for bg command\n");
             log_output("Error: invalid arguments for bg command\n~");
             return true;
         }
-        if (!(job = search_job_pos(position)))
+        if (!(job = jobs_find_spec(argv[1])))
         {
 //            printf("%d %d", position, argc);
             printf("Error: Could not find requested job\n");
@@ -440,11 +618,16 @@ bool builtin_cmd(job_t *last_job, int argc, char **argv)
             log_output("Error: this job is already completed.\n~");
             return true;
         }
-        char log[1024];
-        snprintf(log,1024,  "#Sending job '%s' to background\n~", job->commandinfo);
-        log_output(log);
+        string log = string("#Sending job '") + job->commandinfo + "' to background\n~";
+        log_output(&log[0]);
         printf("#Sending job '%s' to background\n", job->commandinfo);
         fflush(stdout);
+        if (sched_cancel(job))
+        {
+            /* queued: start it now, whatever the limits say */
+            spawn_job(job, false);
+            return true;
+        }
         continue_job(job);
         job->bg = true;
         job->notified = false;
@@ -455,13 +638,12 @@ bool builtin_cmd(job_t *last_job, int argc, char **argv)
     else if (!strcmp("fg", argv[0]))
     {
         remove_finished_jobs();
-        int pos = 0;
         job_t *job;
 
         //no arguments specified, use last job
         if (argc == 1)
         {
-            job = search_job_pos(-1);
+            job = jobs_last();
             if (!job) {
                 printf("Error: No job in job list\n");
                 log_output("Error: No job in job list\n~");
@@ -469,9 +651,9 @@ bool builtin_cmd(job_t *last_job, int argc, char **argv)
             }
         }
             //right arguments given, find respective job
-        else if (argc == 2 && (pos = atoi(argv[1])))
+        else if (argc == 2)
         {
-            if (!(job = search_job_pos(pos)))
+            if (!(job = jobs_find_spec(argv[1])))
             {
                 printf("Error: Could not find requested job\n");
                 log_output("Error: Could not find requested job\n~");
@@ -496,11 +678,26 @@ bool builtin_cmd(job_t *last_job, int argc, char **argv)
             log_output("Error: invalid arguments for fg command\n~");
             return true;
         }
-        char log[1024];
-        snprintf(log,1024,  "#Sending job '%s' to foreground\n~", job->commandinfo);
-        log_output(log);
+        string log = string("#Sending job '") + job->commandinfo + "' to foreground\n~";
+        log_output(&log[0]);
         printf("#Bringing job '%s' to foreground\n", job->commandinfo);
         fflush(stdout);
+        if (sched_cancel(job))
+        {
+            job->bg = false;
+            spawn_job(job, true);
+            return true;
+        }
+        if (job->capture)
+        {
+            capture_set_live(job->capture, true);
+        }
+        /* the foreground wait reaps it now; take over what was reaped */
+        for (process_t *q = job->first_process; q; q = q->next)
+        {
+            reaper_forget(q->pid);
+        }
+        reaper_collect(jobs_find_pid);
         continue_job(job);
         job->bg = false;
 
@@ -508,204 +705,603 @@ bool builtin_cmd(job_t *last_job, int argc, char **argv)
             seize_tty(job->pgid);
 
         int pid = parent_wait(job, true);
+        if (!job_is_completed(job))
+        {
+            /* stopped again */
+            if (job->capture)
+            {
+                capture_set_live(job->capture, false);
+            }
+            for (process_t *q = job->first_process; q; q = q->next)
+            {
+                reaper_watch(q);
+            }
+        }
         printf("%d\n", pid);
-        process_t *p = getProcess(pid);
-        if (p->next == NULL && !assigncmd)
+        process_t *p = jobs_find_pid(pid);
+        if (p && p->next == NULL && !subst_output && !p->ofile && job_is_completed(job))
         {
-            if (p->ofile)
+            report_output(job, p);
+        }
+        return true;
+    }
+    else if (!strcmp("spawner", argv[0]))
+    {
+        //launch backend; "spawner fork|posix_spawn|zygote" switches,
+        //"spawner -b [launches [heap MB]]" times each of them
+        string log;
+        if (argc >= 2 && !strcmp(argv[1], "-b"))
+        {
+            string out = spawn_benchmark(argc > 2 ? atoi(argv[2]) : 1000, argc > 3 ? atoi(argv[3]) : 0);
+            printf("%s", out.c_str());
+            out += "~";
+            log_output(&out[0]);
+            return true;
+        }
+        if (argc == 2 && !set_spawn_backend(argv[1]))
+        {
+            log = string("Error: unknown spawn backend ") + argv[1] + "\n";
+        }
+        else
+        {
+            log = string("spawn backend: ") + spawn_backend_name(spawn_backend) + "\n";
+        }
+        printf("%s", log.c_str());
+        log += "~";
+        log_output(&log[0]);
+        return true;
+    }
+    else if (!strcmp("sched", argv[0]))
+    {
+        //background job scheduler: -j N caps the running jobs (0: no cap),
+        //-l LOAD holds jobs back while the load average is at LOAD or more,
+        //-c on|off gates them on runnable CPUs; prints the settings
+        int running;
+        double load;
+        bool cpus;
+        sched_get_limits(&running, &load, &cpus);
+        string out;
+        for (int i = 1; i < argc; i++)
+        {
+            if (i + 1 < argc && !strcmp(argv[i], "-j"))
+            {
+                running = atoi(argv[++i]);
+            }
+            else if (i + 1 < argc && !strcmp(argv[i], "-l"))
             {
+                load = atof(argv[++i]);
+            }
+            else if (i + 1 < argc && !strcmp(argv[i], "-c"))
+            {
+                cpus = !strcmp(argv[++i], "on");
             }
             else
             {
-                char name[20];
-                snprintf(name, 20, "logs/%d.log", p->pid);
-                FILE *out = fopen(name, "r+");
-                fseek(out, 0, SEEK_END);
-                int lSize = ftell(out);
-                rewind(out);
-                if (lSize != 0)
-                {
-                    char *buffer = (char *)calloc(1, lSize + 1);
-                    if (1 != fread(buffer, lSize, 1, out))
-                    {
-                        fclose(out), free(buffer), fputs("entire read fails", stderr), exit(1);
-                    }
-                    printf("%s\n", buffer);
-                    strcat(buffer, "~");
-                    log_output(buffer);
-                }
-                else
+                out = "Error: usage: sched [-j max running] [-l max load] [-c on|off]\n";
+                break;
+            }
+        }
+        if (out.empty())
+        {
+            sched_set_limits(running, load, cpus);
+            sched_dispatch(); /* a higher limit may let queued jobs go */
+            out = sched_status();
+        }
+        printf("%s", out.c_str());
+        out += "~";
+        log_output(&out[0]);
+        return true;
+    }
+    else if (!strcmp("place", argv[0]))
+    {
+        //default placement of fg or bg jobs: place bg --nice 10 --io idle,
+        //place fg --cpus 0-3; run --cpus ... cmd overrides it for one job
+        string out = place_builtin(argc, argv);
+        printf("%s", out.c_str());
+        out += "~";
+        log_output(&out[0]);
+        return true;
+    }
+    else if (!strcmp("ulimit", argv[0]))
+    {
+        //default resource limits of the jobs launched from now on: -a lists
+        //them, -t 10 or cpu=10 (as=2G, nofile=64...) sets one, and a value
+        //of unlimited clears it; dsh itself is never limited
+        string out = limits_ulimit(argc, argv);
+        printf("%s", out.c_str());
+        out += "~";
+        log_output(&out[0]);
+        return true;
+    }
+    else if (!strcmp("hash", argv[0]))
+    {
+        //command path hash; -r empties it, -l lists it as reusable input,
+        //-p path name pins a path, and names are looked up right away
+        string out;
+        char log[1024];
+        if (argc == 2 && !strcmp(argv[1], "-r"))
+        {
+            path_hash_clear();
+        }
+        else if (argc == 4 && !strcmp(argv[1], "-p"))
+        {
+            path_hash_add(argv[3], argv[2]);
+        }
+        else if (argc == 2 && !strcmp(argv[1], "-l"))
+        {
+            out = path_hash_list(true);
+        }
+        else if (argc > 1)
+        {
+            for (int i = 1; i < argc; i++)
+            {
+                if (!path_hash_lookup(argv[i]))
                 {
-                    char buffer[1024];
-                    snprintf(buffer, sizeof(buffer), "%s: Command not found.\n~", p->argv[0]);
-                    log_output(buffer);
-                    printf("%s: Command not found.\n", p->argv[0]);
+                    out = out + "hash: " + argv[i] + ": not found\n";
                 }
-                fclose(out);
             }
         }
+        else
+        {
+            unsigned long hits, walks;
+            unsigned entries;
+            path_hash_stats(&hits, &walks, &entries);
+            out = "hits\tcommand\n" + path_hash_list(false);
+            snprintf(log, 1024, "command hash: %u entries, %lu hits, %lu PATH walks\n", entries, hits, walks);
+            out += log;
+        }
+        printf("%s", out.c_str());
+        out += "~";
+        log_output(&out[0]);
+        return true;
+    }
+    else if (!strcmp("peek", argv[0]))
+    {
+        //latest output of a job: "peek %N" or "peek N"; the last job by default
+        job_t *job = NULL;
+        if (argc == 1)
+        {
+            job = jobs_last();
+        }
+        else if (argc == 2)
+        {
+            job = jobs_find_spec(argv[1]);
+        }
+        if (!job || !job->capture)
+        {
+            printf("Error: no captured output for that job\n");
+            log_output("Error: no captured output for that job\n~");
+            return true;
+        }
+        size_t dropped;
+        string out = capture_contents(job->capture, &dropped);
+        if (dropped)
+        {
+            char note[128];
+            snprintf(note, sizeof(note), "[%zu bytes of earlier output dropped]\n", dropped);
+            out.insert(0, note);
+        }
+        if (!capture_done(job->capture))
+        {
+            out += "[still running]\n";
+        }
+        printf("%s", out.c_str());
+        out += "~";
+        log_output(&out[0]);
+        return true;
+    }
+    else if (!strcmp("pcache", argv[0]))
+    {
+        //parse cache counters; "pcache -c" empties the cache
+        if (argc == 2 && !strcmp(argv[1], "-c"))
+        {
+            parse_cache_clear();
+        }
+        unsigned long hits, misses;
+        unsigned entries;
+        parse_cache_stats(&hits, &misses, &entries);
+        char log[1024];
+        snprintf(log, 1024, "parse cache: %u entries, %lu hits, %lu misses\n", entries, hits, misses);
+        printf("%s", log);
+        strcat(log, "~");
+        log_output(log);
         return true;
     }
     return false; /* not a builtin command */
 }
 
+/* Print a foreground job's output and append it to output.log */
+void report_text(const char *text, size_t len)
+{
+    char *buffer = (char *)malloc(len + 2);
+    memcpy(buffer, text, len);
+    buffer[len] = '\0';
+    printf("%s\n", buffer);
+    strcat(buffer, "~");
+    log_output(buffer);
+    free(buffer);
+}
+
+/* Print what the last process p of a finished foreground job wrote into
+ * the job's capture, unless it was streamed already, and append it to
+ * output.log */
+void report_output(job_t *j, process_t *p)
+{
+    if (p->pid < 0)
+    {
+        char buffer[1024];
+        snprintf(buffer, sizeof(buffer), "%s: Command not found.\n~", p->argv[0]);
+        log_output(buffer);
+        printf("%s: Command not found.\n", p->argv[0]);
+        return;
+    }
+    if (!j->capture)
+    {
+        return; /* no pipe could be set up; it wrote to the terminal */
+    }
+    /* what is in the pipe by now; a process it left behind may hold the
+     * pipe open, and what that writes later is not waited for */
+    capture_drain(j->capture);
+    size_t dropped;
+    string out = capture_contents(j->capture, &dropped);
+    if (dropped)
+    {
+        char note[128];
+        snprintf(note, sizeof(note), "[%zu bytes of earlier output dropped]\n", dropped);
+        out.insert(0, note);
+    }
+    if (!out.empty() && capture_relayed(j->capture))
+    {
+        printf("\n");
+        out += "~";
+        log_output(&out[0]);
+    }
+    else if (!out.empty())
+    {
+        report_text(out.data(), out.size());
+    }
+    else
+    {
+        string log = string("Note: ") + p->argv[0] + " command has no output\n~";
+        log_output(&log[0]);
+    }
+}
+
+/* Add output of the running $(...) to its value, up to subst_max bytes */
+static void subst_append(const char *data, size_t len)
+{
+    size_t room = subst_max > subst_output->size() ? subst_max - subst_output->size() : 0;
+    if (len > room)
+    {
+        fprintf(stderr, "dsh: command substitution output cut at %zu bytes\n", subst_max);
+        len = room;
+    }
+    subst_output->append(data, len);
+}
+
+/* Output of the $(...) command as it is read; past the cap it is read and
+ * dropped so the command is not left blocked on a full pipe */
+static void subst_read(const char *data, size_t len)
+{
+    if (subst_output->size() < subst_max)
+    {
+        subst_append(data, len);
+    }
+}
+
+/* Read the $(...) pipe of a job dsh does not wait for to the end */
+static void read_substitution(int fd)
+{
+    char buf[65536];
+    while (1)
+    {
+        ssize_t n = read(fd, buf, sizeof(buf));
+        if (n < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        if (n <= 0)
+        {
+            break;
+        }
+        subst_read(buf, n);
+    }
+}
+
+/* A fast builtin standing in for one stage of a foreground job; owned by
+ * the stage thread when there is one */
+struct fast_stage
+{
+    process_t *p;
+    fast_builtin_fn fn;
+    fast_out_t out;
+    int status;
+};
+
+static void run_fast_stage(fast_stage *s)
+{
+    s->status = run_fast_builtin(s->fn, s->p->argc, s->p->argv, &s->out);
+}
+
+/* The stages of a job that run on threads of their own */
+struct stage_threads
+{
+    vector<pair<thread, fast_stage *>> threads;
+};
+
+/* Wait for j's stage threads and take their statuses.  A job stopped with
+ * ^Z keeps its threads, which may be blocked on a full pipe until it is
+ * continued; they use its arena, so they are joined before it goes. */
+void join_stages(job_t *j)
+{
+    if (!j->stages)
+    {
+        return;
+    }
+    for (auto &t : j->stages->threads)
+    {
+        t.first.join();
+        t.second->p->status = t.second->status;
+        delete t.second;
+    }
+    delete j->stages;
+    j->stages = NULL;
+}
+
 void spawn_job(job_t *j, bool fg)
 {
     pid_t pid;
     process_t *p;
-    addJob(j);
-    int prev_pipe[2];
+    process_t *last = NULL; /* stage whose output is reported */
+    if (!j->id)
+    {
+        limits_merge(j); /* the ulimit defaults as of its launch */
+        place_merge(j, fg);
+        jobs_add(j);
+        /* a new background job waits its turn; $(...) needs it right away */
+        if (!fg && !subst_output && !sched_admit())
+        {
+            sched_enqueue(j);
+            string log = "[" + to_string(j->id) + "]   Queued" + string(18, ' ') + j->commandinfo + "\n";
+            if (dsh_is_interactive)
+            {
+                printf("%s", log.c_str());
+            }
+            log += "~";
+            log_output(&log[0]);
+            return;
+        }
+    }
+    int in_fd = -1; /* read end of the pipe from the previous stage */
+    bool launched = false;   /* any real child to wait for */
+    int subst_fd = -1;       /* read end of the $(...) output pipe */
+    fast_stage *last_fast = NULL;
+    stage_threads stages;
+    if (fg)
+    {
+        fflush(stdout); /* before the job's output is streamed past stdio */
+    }
 
     for (p = j->first_process; p; p = p->next)
     {
         /* YOUR CODE HERE? */
-        if (p->argv[0] == NULL)
+        char **argv = process_argv(j, p);
+        if (!argv || argv[0] == NULL)
         {
             continue;
         }
-        int next_pipe[2];
 
-        pipe(next_pipe);
-        /* Builtin commands are already taken care earlier */
-        switch (pid = fork())
+        /* Everything handed to the child is O_CLOEXEC: the backend dups it
+         * onto stdin/stdout and the originals go away at exec */
+        int next_pipe[2] = {-1, -1};
+        int out_fd = -1;
+        if (p->next)
         {
+            pipe2(next_pipe, O_CLOEXEC);
+            out_fd = next_pipe[PIPE_WRITE];
+        }
 
-            case -1: /* fork failure */
-                perror("fork");
-                exit(EXIT_FAILURE);
-
-            case 0: /* child process  */
-                p->pid = getpid();
-
-                set_pgid(j, p);
-
-                if (p != j->first_process)
-                {
-                    close(prev_pipe[PIPE_WRITE]);
-                    dup2(prev_pipe[PIPE_READ], STDIN_FILENO);
-                    close(prev_pipe[PIPE_READ]);
-                }
-                if (p->next)
+        /* echo, printf, test... in the foreground run inside dsh: inline,
+         * or on a thread when the stage feeds a pipe; not under limits,
+         * which only a child of its own can be held to */
+        bool main_thread = false;
+        fast_builtin_fn fn = fg && !j->limit_mask ? fast_builtin(argv[0], &main_thread) : NULL;
+        if (fn)
+        {
+            fast_stage *s = new fast_stage{p, fn, fast_out_t(), 0};
+            s->out.fd = out_fd;
+            s->out.owns_fd = true;
+            if (p->ofile)
+            {
+                if (out_fd >= 0)
                 {
-                    close(next_pipe[PIPE_READ]);
-                    dup2(next_pipe[PIPE_WRITE], STDOUT_FILENO);
-                    close(next_pipe[PIPE_WRITE]);
+                    close(out_fd);
                 }
-                else
-                {
-                    if (assigncmd)
-                    {
-                        int log = open("slogs.log", O_WRONLY | O_CREAT | O_TRUNC, 0666);
-                        dup2(log, STDOUT_FILENO);
-                        close(log);
-                    }
-                    else
-                    {
-                        if (p->ofile)
-                        {
-                            dup2(STDOUT_FILENO, next_pipe[PIPE_WRITE]);
-                            char log[1024];
-                            snprintf(log, 1024, "Command output is redirected to %s~", p->ofile);
-                            log_output(log);
-                        }
-                        else
-                        {
-                            char name[20];
-                            snprintf(name, 20, "logs/%d.log", p->pid);
-                            int log = creat(name, 0644);
-                            dup2(STDOUT_FILENO, next_pipe[PIPE_WRITE]);
-                            dup2(log, STDOUT_FILENO);
-                            close(log);
-                        }
-                    }
+                string log = string("Command output is redirected to ") + p->ofile + "~";
+                log_output(&log[0]);
+                s->out.fd = open(p->ofile, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+            }
+            /* they never read stdin; the writer of the previous stage gets EPIPE */
+            if (in_fd >= 0)
+            {
+                close(in_fd);
+            }
+            in_fd = next_pipe[PIPE_READ];
+            last = p;
 
-                    close(next_pipe[PIPE_READ]);
-                    close(next_pipe[PIPE_WRITE]);
-                }
+            /* the job is done with the stage as far as waiting goes */
+            p->completed = true;
+            if (p->next && !main_thread)
+            {
+                stages.threads.push_back(make_pair(thread(run_fast_stage, s), s));
+                continue;
+            }
+            run_fast_stage(s);
+            p->status = s->status;
+            if (!p->next && s->out.fd < 0)
+            {
+                last_fast = s; /* its output is reported below */
+            }
+            else
+            {
+                delete s;
+            }
+            continue;
+        }
 
-                new_child(j, p, fg);
-                redirect(p);
-                if (execvp(p->argv[0], p->argv) < 0)
+        if (!p->next)
+        {
+            if (subst_output)
+            {
+                int subst_pipe[2];
+                if (pipe2(subst_pipe, O_CLOEXEC) == 0)
                 {
-                    //char buffer[1024];
-                    //snprintf(buffer, sizeof(buffer), "%s: Command not found.\n~", p->argv[0]);
-                    //log_output(buffer);
-                    //printf("%s: Command not found.", p->argv[0]);
-                    exit(EXIT_FAILURE);
+                    out_fd = subst_pipe[PIPE_WRITE];
+                    subst_fd = subst_pipe[PIPE_READ];
                 }
-
-                perror("New child should have done an exec");
-                exit(EXIT_FAILURE); /* NOT REACHED */
-
-            default: /* parent */
-                /* establish child process group */
-                p->pid = pid;
-                set_pgid(j, p);
-
-                /* YOUR CODE HERE?  Parent-side code for new process.  */
-                prev_pipe[PIPE_WRITE] = next_pipe[PIPE_WRITE];
-                prev_pipe[PIPE_READ] = next_pipe[PIPE_READ];
-                break;
+            }
+            else if (p->ofile)
+            {
+                string log = string("Command output is redirected to ") + p->ofile + "~";
+                log_output(&log[0]);
+            }
+            else
+            {
+                /* foreground output streams to the terminal as it comes */
+                j->capture = capture_open(&out_fd, fg);
+            }
         }
 
+        /* Builtin commands are already taken care earlier */
+        usage_started(p);
+        pid = launch_process(j, p, fg, in_fd, out_fd);
+        if (pid < 0)
+        {
+            p->pid = -1;
+            p->completed = true;
+        }
+        else
+        {
+            watch_process(p);
+            jobs_track(j, p);
+            if (!fg)
+            {
+                reaper_watch(p);
+            }
+        }
+        if (pid >= 0 && !launched)
+        {
+            /* when a fast builtin feeds the first real stage, no child
+             * has the terminal on its stdin to claim it */
+            launched = true;
+            if (fg && in_fd >= 0 && isatty(STDIN_FILENO))
+            {
+                seize_tty(j->pgid);
+            }
+        }
         /* YOUR CODE HERE?  Parent-side code for new job.*/
-        if (p->next == NULL)
+        if (out_fd >= 0)
+        {
+            close(out_fd);
+        }
+        if (in_fd >= 0)
         {
-            close(next_pipe[PIPE_READ]);
+            close(in_fd);
         }
-        close(prev_pipe[PIPE_WRITE]);
+        in_fd = next_pipe[PIPE_READ];
+        last = p;
+    }
+    if (in_fd >= 0)
+    {
+        close(in_fd);
+    }
+    if (subst_fd >= 0 && !(launched && fg))
+    {
+        read_substitution(subst_fd);
+        close(subst_fd);
+        subst_fd = -1;
+    }
+
+    if (!fg)
+    {
+        sched_started(j);
+    }
 
-        parent_wait(j, fg);
-        if (fg && p->next == NULL && !assigncmd)
+    /* every stage is running and connected; only now wait for the job.  A
+     * $(...) pipe is read while waiting, so a big output cannot fill it for
+     * good, and a command stopped with ^Z leaves dsh free. */
+    if (launched)
+    {
+        parent_wait(j, fg, subst_fd, subst_read);
+        if (subst_fd >= 0)
         {
-            if (p->ofile)
+            close(subst_fd);
+        }
+        if (fg && !job_is_completed(j))
+        {
+            /* stopped with ^Z: it is a background job now */
+            if (j->capture)
             {
+                capture_set_live(j->capture, false);
             }
-            else
+            for (process_t *q = j->first_process; q; q = q->next)
             {
-                char name[20];
-                snprintf(name, 20, "logs/%d.log", p->pid);
-                FILE *out = fopen(name, "r+");
-                fseek(out, 0, SEEK_END);
-                int lSize = ftell(out);
-                rewind(out);
-                if (lSize != 0)
-                {
-                    char *buffer = (char *)calloc(1, lSize + 1);
-                    if (1 != fread(buffer, lSize, 1, out))
-                    {
-                        fclose(out), free(buffer), fputs("entire read fails", stderr), exit(1);
-                    }
-                    printf("%s\n", buffer);
-                    strcat(buffer, "~");
-                    log_output(buffer);
-                }
-                else
-                {
-                    char buffer[1024];
-                    snprintf(buffer, sizeof(buffer), "%s: Command not found.\n~", p->argv[0]);
-                    log_output(buffer);
-                    printf("%s: Command not found.\n", p->argv[0]);
-                }
-                fclose(out);
+                reaper_watch(q);
             }
         }
-        else if (!fg && p->next == NULL && !assigncmd)
+    }
+    else if (fg && isatty(STDIN_FILENO))
+    {
+        seize_tty(getpid());
+    }
+    if (!stages.threads.empty())
+    {
+        j->stages = new stage_threads(move(stages));
+        if (!job_is_stopped(j) || job_is_completed(j))
         {
-            if (p->ofile)
+            join_stages(j);
+        }
+    }
+    if (!last || subst_output)
+    {
+        if (last_fast && subst_output)
+        {
+            subst_append(last_fast->out.buf.data(), last_fast->out.buf.size());
+        }
+        delete last_fast;
+        return;
+    }
+    if (fg)
+    {
+        if (last_fast)
+        {
+            if (!last_fast->out.buf.empty())
             {
-                char log[1024];
-                snprintf(log, 1024, "Command output is redirected to %s~", p->ofile);
-                log_output(log);
+                report_text(last_fast->out.buf.data(), last_fast->out.buf.size());
             }
             else
             {
-                char log[1024];
-                snprintf(log, 1024, "Note: the output is written in logs/%d.log\n~", p->pid);
-                log_output(log);
+                string log = string("Note: ") + last->argv[0] + " command has no output\n~";
+                log_output(&log[0]);
             }
+            delete last_fast;
+        }
+        else if (!last->ofile && job_is_completed(j))
+        {
+            report_output(j, last);
         }
     }
+    else if (last->ofile)
+    {
+        string log = string("Command output is redirected to ") + last->ofile + "~";
+        log_output(&log[0]);
+    }
+    else
+    {
+        char log[1024];
+        snprintf(log, 1024, "Note: the output is kept in memory; see peek %%%d\n~", j->id);
+        log_output(log);
+    }
 }
 
 void assignment(string cmdline)
@@ -718,36 +1314,29 @@ void assignment(string cmdline)
         if (value[index + 1] == '(')
         {
             // its a command
-            string unixcmd = value.substr(index + 2, value.find(')') - index - 2);
-            assigncmd = true;
-            job_t *tmp = readcommandline(unixcmd.c_str());
-            while (tmp)
+            /* up to the matching paren, so a nested $(...) stays whole */
+            size_t end = index + 2;
+            for (int depth = 1; end < value.size(); end++)
             {
-                int argc = tmp->first_process->argc;
-                char **argv = tmp->first_process->argv;
-                if (!builtin_cmd(tmp, argc, argv))
+                if (value[end] == '(')
                 {
-                    spawn_job(tmp, !(tmp->bg));
+                    depth++;
+                }
+                else if (value[end] == ')' && --depth == 0)
+                {
+                    break;
                 }
-                tmp = tmp->next;
-            }
-
-            string output = "";
-            string line;
-            ifstream myfile;
-            myfile.open("slogs.log");
-            if (!myfile.is_open())
-            {
-                perror("Error open");
-                exit(EXIT_FAILURE);
-            }
-            while (getline(myfile, line))
-            {
-                output += line;
             }
+            string unixcmd = value.substr(index + 2, end - index - 2);
+            string output;
+            string *outer = subst_output; /* restored for nested substitutions */
+            subst_output = &output;
+            run_jobs(readcommandline(unixcmd.c_str()), false);
+            subst_output = outer;
+
+            /* like sh: trailing newlines go, the ones inside stay */
+            output.erase(output.find_last_not_of('\n') + 1);
             strVariables[var] = output;
-            myfile.close();
-            assigncmd = false;
         }
         else
         {
@@ -809,7 +1398,11 @@ string parse(string cmdline)
                 i++;
             }
             string key = cmdline.substr(tp + 1, i - tp - 1);
-            res += strVariables.count(key) ? strVariables[key] : "";
+            string value = strVariables.count(key) ? strVariables[key] : "";
+            /* a $(...) value keeps its newlines; on a command line they
+             * only separate words */
+            replace(value.begin(), value.end(), '\n', ' ');
+            res += value;
             if (cmdline[i] == '+' || cmdline[i] == '-')
             {
                 res.push_back(cmdline[i]);
@@ -877,76 +1470,145 @@ int calculate(string cmdline)
 
 void add_command_to_history(const char *command)
 {
-    if (history_count < 100)
-    {
-        history[history_count++] = strdup(command);
-    }
-    else
+    hist_add(command);
+}
+
+/* Next line for the interactive shell mode, from the batch input when dsh
+ * runs a script */
+bool read_shell_line(string &line)
+{
+    if (batch_active())
     {
-        free((void *)history[0]);
-        for (unsigned index = 1; index < 100; index++)
+        char *text;
+        size_t len;
+        if (!batch_getline(&text, &len))
         {
-            history[index - 1] = history[index];
+            return false;
         }
-        history[99] = strdup(command);
+        line.assign(text, len);
+        return true;
     }
+    return (bool)getline(cin, line);
 }
 
-void log_output(char *output)
+/* The body of a shell mode for loop; the first line read after the for
+ * line is the "do" */
+struct for_loop
 {
-    if (history_count < 100)
-    {
-        FILE *f = fopen("output.log", "a");
-        fprintf(f, "%s\n", output);
-        fclose(f);
-    }
-    else
-    {
-        FILE *fp, *fp2;
-        long lSize;
-        char *buffer;
+    string var;
+    vector<string> *commands;
+};
 
-        fp = fopen("output.log", "r+");
-        fp2 = fopen("tmp.log", "w+");
-        fseek(fp, 0L, SEEK_END);
-        lSize = ftell(fp);
-        rewind(fp);
-
-        buffer = (char *)calloc(1, lSize + 1);
+/* Run the body once with the loop variable set to value */
+static void for_iteration(int value, void *arg)
+{
+    for_loop *loop = (for_loop *)arg;
+    vector<string> &commands = *loop->commands;
+    intVariables[loop->var] = value;
+    strVariables[loop->var] = to_string(value);
+    for (size_t i = 1; i < commands.size(); i++)
+    {
+        string tcmd = commands[i];
 
-        if (1 != fread(buffer, lSize, 1, fp))
+        if (isArithmetic(tcmd))
+        {
+            tcmd = parse(tcmd);
+            int ans = 0;
+            if (tcmd.find('=') != string::npos)
+            {
+                ans = calculate(tcmd.substr(tcmd.find("=") + 1));
+                string key = tcmd.substr(0, tcmd.find("="));
+                assignment(key + "=" + to_string(ans));
+            }
+            else
+            {
+                ans = calculate(tcmd);
+            }
+            cout << ans << endl;
+        }
+        else if (tcmd.find("=") != string::npos)
         {
-            fclose(fp), free(buffer), fputs("3entire read fails", stderr), exit(1);
+            assignment(tcmd);
         }
-        char *o = strtok(buffer, "~");
-        o = strtok(NULL, "~");
-        while (o != NULL)
+        else
         {
-            fprintf(fp2, "%s~", o);
-            o = strtok(NULL, "~");
+            tcmd = parse(tcmd);
+            run_jobs(readcommandline(tcmd.c_str()), false);
         }
-        fprintf(fp2, "%s\n", output);
-        int ret = rename("tmp.log", "output.log");
-        ret = remove("tmp.log");
-        fclose(fp);
-        fclose(fp2);
-        /* do your work here, buffer is a string contains the whole text */
-        free(buffer);
     }
 }
 
-int main()
+/* "for i in {1..8} -P 4": a loop that runs its iterations in parallel */
+static bool parallel_for_line(const string &cmdline)
 {
+    return cmdline.compare(0, 4, "for ") == 0 && cmdline.find(" -P ") != string::npos;
+}
+
+int main(int argc, char **argv)
+{
+    const char *script = NULL;
+    if (argc == 3 && !strcmp(argv[1], "--zygote"))
+    {
+        zygote_main(atoi(argv[2])); /* the launch helper; never returns */
+    }
+    if (argc == 3 && !strcmp(argv[1], "-f"))
+    {
+        script = argv[2];
+    }
+    else if (argc != 1)
+    {
+        fprintf(stderr, "usage: %s [-f script]\n", argv[0]);
+        exit(EXIT_FAILURE);
+    }
+
+    if (getenv("DSH_SUBST_MAX") && atol(getenv("DSH_SUBST_MAX")) > 0)
+    {
+        subst_max = atol(getenv("DSH_SUBST_MAX"));
+    }
+    if (getenv("DSH_SPAWN") && !set_spawn_backend(getenv("DSH_SPAWN")))
+    {
+        fprintf(stderr, "DSH_SPAWN: unknown spawn backend %s\n", getenv("DSH_SPAWN"));
+    }
     init_dsh();
-    FILE *f = fopen("output.log", "w");
-    fclose(f);
+    log_open();
+    hist_open();
+    search_open();
+
+    /* scripts, and a script file on stdin, are read and parsed ahead on a
+     * helper thread.  A pipe is read a byte at a time instead, never past
+     * the line being run: the commands it starts may read it too. */
+    struct stat in_st;
+    bool stdin_file = !isatty(STDIN_FILENO) && fstat(STDIN_FILENO, &in_st) == 0 && S_ISREG(in_st.st_mode);
+    if ((script || stdin_file) && !batch_open(script))
+    {
+        exit(EXIT_FAILURE);
+    }
+    if (!script && !stdin_file && !isatty(STDIN_FILENO))
+    {
+        setvbuf(stdin, NULL, _IONBF, 0);
+    }
+
     while (1)
     {
         job_t *j = NULL;
-        if (!(j = readcmdline(promptmsg())))
+        bool eof = false;
+        if (batch_active())
+        {
+            j = batch_next(&eof);
+        }
+        else
+        {
+            remove_finished_jobs(); /* "[N]+ Done" notices go before the prompt */
+            if (!(j = readcmdline(promptmsg())))
+            {
+                eof = feof(stdin);
+            }
+        }
+        if (!j)
         {
-            if (feof(stdin))
+            if (eof)
             { /* End of file (ctrl-d) */
+                sched_drain(); /* queued jobs were promised a run */
                 fflush(stdout);
                 printf("\n");
                 exit(EXIT_SUCCESS);
@@ -962,13 +1624,13 @@ int main()
                 string cmdline;
 
                 fprintf(stdout, ">>> ");
-                getline(cin, cmdline);
-                if (cmdline.compare("exit") == 0)
+                if (!read_shell_line(cmdline) || cmdline.compare("exit") == 0)
                 {
                     strVariables.clear();
                     break;
                 }
-                else if (isArithmetic(cmdline))
+                /* the -P of a parallel loop is no minus */
+                else if (isArithmetic(cmdline) && !parallel_for_line(cmdline))
                 {
                     cmdline = parse(cmdline);
                     int ans = 0;
@@ -989,7 +1651,7 @@ int main()
                 {
                     assignment(cmdline);
                 }
-                else if (cmdline.substr(0, 3).compare("for") == 0)
+                else if (cmdline.compare(0, 4, "for ") == 0)
                 {
                     string var = cmdline.substr(cmdline.find(" ") + 1);
                     // cout << "var: " << var << endl;
@@ -1001,12 +1663,15 @@ int main()
                     int end = forinfo[1];
                     int step = forinfo[2];
                     delete forinfo;
+                    /* "-P N" after the range runs N iterations at a time */
+                    size_t opt = cmdline.find(" -P ");
+                    int workers = opt == string::npos ? 1 : atoi(cmdline.c_str() + opt + 4);
                     intVariables[var] = start;
                     strVariables[var] = to_string(start);
 
                     string forcommand;
                     vector<string> commands;
-                    while (getline(cin, forcommand))
+                    while (read_shell_line(forcommand))
                     {
                         forcommand = forcommand.substr(forcommand.find_first_not_of(" \t"));
                         if (forcommand == "done")
@@ -1018,48 +1683,16 @@ int main()
                             commands.push_back(forcommand);
                         }
                     }
-                    for (intVariables[var] = start; intVariables[var] <= end; intVariables[var] += step)
+                    for_loop loop = {var, &commands};
+                    if (workers > 1)
                     {
-                        strVariables[var] = to_string(intVariables[var]);
-                        for (int i = 1; i < commands.size(); i++)
+                        for_parallel(start, end, step, workers, for_iteration, &loop);
+                    }
+                    else
+                    {
+                        for (intVariables[var] = start; intVariables[var] <= end; intVariables[var] += step)
                         {
-                            string tcmd = commands[i];
-
-                            if (isArithmetic(tcmd))
-                            {
-                                tcmd = parse(tcmd);
-                                int ans = 0;
-                                if (tcmd.find('=') != string::npos)
-                                {
-                                    ans = calculate(tcmd.substr(tcmd.find("=") + 1));
-                                    string key = tcmd.substr(0, tcmd.find("="));
-                                    assignment(key + "=" + to_string(ans));
-                                }
-                                else
-                                {
-                                    ans = calculate(tcmd);
-                                }
-                                cout << ans << endl;
-                            }
-                            else if (tcmd.find("=") != string::npos)
-                            {
-                                assignment(tcmd);
-                            }
-                            else
-                            {
-                                tcmd = parse(tcmd);
-                                job_t *tmp = readcommandline(tcmd.c_str());
-                                while (tmp)
-                                {
-                                    int argc = tmp->first_process->argc;
-                                    char **argv = tmp->first_process->argv;
-                                    if (!builtin_cmd(tmp, argc, argv))
-                                    {
-                                        spawn_job(tmp, !(tmp->bg));
-                                    }
-                                    tmp = tmp->next;
-                                }
-                            }
+                            for_iteration(intVariables[var], &loop);
                         }
                     }
                     commands.clear();
@@ -1068,21 +1701,10 @@ int main()
                 else
                 {
                     cmdline = parse(cmdline);
-                    job_t *tmp = readcommandline(cmdline.c_str());
-                    while (tmp)
-                    {
-                        int argc = tmp->first_process->argc;
-                        char **argv = tmp->first_process->argv;
-                        if (!builtin_cmd(tmp, argc, argv))
-                        {
-                            spawn_job(tmp, !(tmp->bg));
-                        }
-                        tmp = tmp->next;
-                    }
+                    run_jobs(readcommandline(cmdline.c_str()), false);
                 }
             }
-            free(j->commandinfo);
-            free(j);
+            free_job(j);
             interactive_shell = false;
             continue;
         }
@@ -1100,23 +1722,6 @@ int main()
         /* else */
         /* spawn_job(j,false) */
 
-        while (j)
-        {
-            int argc = j->first_process->argc;
-            char **argv = j->first_process->argv;
-            if (!builtin_cmd(j, argc, argv))
-            {
-                spawn_job(j, !(j->bg));
-            }
-            char name[65536];
-            strcat(name, strtok(j->commandinfo, "\n"));
-            if (j->bg)
-            {
-                strcat(name, "&");
-            }
-            add_command_to_history(name);
-            memset(name, 0, 65536);
-            j = j->next;
-        }
+        run_jobs(j, true);
     }
 }
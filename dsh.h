@@ -8,17 +8,19 @@
 #include <stdlib.h>     /* for exit() */
 #include <errno.h>      /* for errno */
 #include <sys/wait.h>   /* for WAIT_ANY */
+#include <sys/resource.h> /* struct rusage, from wait4() */
+#include <stdint.h>     /* uint64_t */
+#include <time.h>       /* struct timespec */
+#include <sched.h>      /* cpu_set_t */
 #include <string.h>     /* strncpy */
 #include <sys/stat.h>   /* file modes */
 #include <fcntl.h>      /* file open */
+#include <string>       /* fast_out_t buffer */
 
-/* Max length of input/output file name specified during I/O redirection */
-#define MAX_LEN_FILENAME 80
-
-/*Max length of the command line */
-#define MAX_LEN_CMDLINE	12000
-
-#define MAX_ARGS 20 /* Maximum number of arguments to any command */
+/* Command lines, file names and argument lists have no fixed limit; a
+ * process keeps this many words inline and only grows into its arena for
+ * longer commands, up to the kernel's ARG_MAX */
+#define INLINE_ARGS 8
 
 /*file descriptors for input and output; the range of fds are from 0 to 1023;
  * 0, 1, 2 are reserved for stdin, stdout, stderr */
@@ -27,39 +29,92 @@
 
 #define MAX_HISTORY 20 /* flush the completed jobs after reaching the MAX_HISTORY */
 
-#define MAX_ARGS 20 /* Maximum number of arguments to any command */
+#define LIMIT_KINDS 9 /* resources a job can be limited in; see limits.cpp */
 
 #define PRINT_INFO 1 /* FLAG for print_job() and other debug info */
 
+/* Per command line bump allocator (arena.cpp); owns every job_t, process_t,
+ * argv string and file name parsed from one line */
+typedef struct arena arena_t;
+
+arena_t *arena_create(size_t size_hint);
+void *arena_alloc(arena_t *a, size_t n);
+void *arena_calloc(arena_t *a, size_t n);
+char *arena_strndup(arena_t *a, const char *s, size_t len);
+void arena_reset(arena_t *a);
+void arena_destroy(arena_t *a);
+void arena_retain(arena_t *a);
+void arena_release(arena_t *a);
+
 /* using bool as built-in; char is better in terms of space utilization, but
  * code is not succint */
 //typedef enum { false, true } bool;
 
+/* A word of a command: a span over the text of its command line */
+typedef struct span {
+        unsigned off;
+        unsigned len;
+} span_t;
+
 /* A process is a single process (a command to run an executable program).  */
 typedef struct process {
         struct process *next;       /* next process in pipeline */
 	    int argc;		            /* useful for free(ing) argv */
-        char **argv;                /* for exec; argv[0] is the path of the executable file; argv[1..] is the list of arguments*/
+        char **argv;                /* for exec; argv[0] is the path of the executable file; argv[1..] is the list of arguments; NULL until process_argv() */
+        span_t *words;              /* argc words of the command as spans over text */
+        int words_cap;              /* capacity of words */
+        size_t arg_bytes;           /* exec size of argv so far, checked against ARG_MAX */
+        const char *text;           /* the parsed command line (arena copy) */
+        span_t words_inline[INLINE_ARGS];   /* words storage for short commands */
+        char *argv_inline[INLINE_ARGS + 1]; /* argv storage for short commands */
         pid_t pid;                  /* process ID */
         bool completed;             /* true if process has completed */
         bool stopped;               /* true if process has stopped */
         int status;                 /* reported status value from job control; 0 on success and nonzero otherwise */
+        int pidfd;                  /* pidfd while the process runs, or -1 */
+        struct rusage usage;        /* resources used, once completed */
+        struct timespec started;    /* CLOCK_MONOTONIC at launch */
+        struct timespec ended;      /* CLOCK_MONOTONIC when reaped */
         char *ifile;                /* stores input file name when < is issued */
         char *ofile;                /* stores output file name when > is issued */
 } process_t;
 
+/* Where a job's processes run (placement.cpp): a CPU set, a nice
+ * increment and an I/O priority, each only when its PLACE_* bit is set */
+#define PLACE_CPUS 1
+#define PLACE_NICE 2
+#define PLACE_IO   4
+
+typedef struct placement {
+        unsigned set;               /* PLACE_* fields given */
+        cpu_set_t cpus;             /* sched_setaffinity() */
+        int nice;                   /* added to dsh's nice value */
+        int io_class, io_level;     /* ioprio_set() class (1 rt, 2 be, 3 idle) and level 0-7 */
+} placement_t;
+
 /* A job is a process itself or a pipeline of processes.
  * Each job has exactly one process group (pgid) containing all the processes in the job. 
  * Each process group has exactly one process that is its leader.
  */
 typedef struct job {
         struct job *next;           /* next job */
+        struct job *prev;           /* previous job in job_list */
+        int id;                     /* job number for %N, stable while the job is listed */
         char *commandinfo;          /* entire command line input given by the user; useful for logging and message display*/
         process_t *first_process;   /* list of processes in this job */
         pid_t pgid;                 /* process group ID */
         bool notified;              /* true if user was informed about stopped job */
         int mystdin, mystdout, mystderr;  /* standard i/o channels */
         bool bg;                    /* true when & is issued on the command line */
+        arena_t *arena;             /* storage of this job and its processes; shared by the jobs of one line */
+        struct capture *capture;    /* stdout of the last process, when dsh collects it */
+        int priority;               /* scheduler priority of a background job (prio N cmd &) */
+        bool queued;                /* listed, but waiting for the scheduler to start it */
+        bool timed;                 /* time cmd ...: report its resource usage when done */
+        unsigned limit_mask;        /* which of limit[] are set, bit k for limit[k] */
+        rlim_t limit[LIMIT_KINDS];  /* setrlimit() soft limits for its processes (limits.cpp) */
+        placement_t place;          /* CPU set, nice and I/O priority of its processes */
+        struct stage_threads *stages;   /* fast builtin stages still running when it stopped */
 } job_t;
 
 /* Finds a job for which the pgid is still -1 (indicates not processed);
@@ -82,12 +137,198 @@ void delete_job(job_t *j, job_t *first_job);
 /* Initialize the members of job structure */
 bool init_job(job_t *j);
 
-/* Initialize the members of process structure */
-bool init_process(process_t *p);
+/* Initialize the members of process structure; argv comes from arena a */
+bool init_process(process_t *p, arena_t *a);
+
+/* Release a job; its storage is recycled with the last job of its line */
+bool free_job(job_t *j);
+
+/* Append a word span to p, growing its words storage in arena a; false when
+ * the argument list would exceed ARG_MAX or memory runs out */
+bool process_add_word(process_t *p, unsigned off, unsigned len, arena_t *a);
+
+/* Build (once) the NULL terminated argv of p from its word spans */
+char **process_argv(job_t *j, process_t *p);
 
 /* Prints the jobs in the list.  */
 void print_job();
 
+/* Child-side setup shared by the launch backends (dsh.cpp) */
+int set_pgid(job_t *j, process_t *p);
+void new_child(job_t *j, process_t *p, bool fg);
+void redirect(process_t *p);
+
+/* Launch backends (spawn.cpp); selected with the spawner builtin or the
+ * DSH_SPAWN environment variable */
+typedef enum { SPAWN_FORK, SPAWN_POSIX, SPAWN_ZYGOTE, SPAWN_BACKENDS } spawn_backend_t;
+
+extern spawn_backend_t spawn_backend;
+const char *spawn_backend_name(spawn_backend_t b);
+bool set_spawn_backend(const char *name);
+pid_t launch_process(job_t *j, process_t *p, bool fg, int in_fd, int out_fd);
+void exec_command(const char *path, char **argv);
+std::string spawn_benchmark(int launches, int heap_mb);
+
+/* Launch helper process (zygote.cpp), started by init_dsh() when selected */
+bool zygote_start();
+void zygote_main(int fd);
+pid_t zygote_process();
+pid_t zygote_launch(job_t *j, process_t *p, const char *path, bool fg, int in_fd, int out_fd);
+
+/* Most bytes of output a $(...) command substitution keeps; DSH_SUBST_MAX
+ * overrides it */
+#define SUBST_MAX (1 << 20)
+
+/* Output capture (capture.cpp): a pipe per job drained into a bounded ring
+ * by the capture thread */
+#define CAPTURE_RING_SIZE (1 << 20)
+
+typedef struct capture capture_t;
+
+capture_t *capture_open(int *write_fd, bool live);
+void capture_set_live(capture_t *c, bool live);
+bool capture_relayed(capture_t *c);
+void capture_release(capture_t *c);
+void capture_drain(capture_t *c);
+bool capture_done(capture_t *c);
+std::string capture_contents(capture_t *c, size_t *dropped);
+void capture_fork_child();
+
+/* Child lifecycle (events.cpp): per-process pidfds and a SIGCHLD signalfd,
+ * so dsh only ever reaps the processes of the job it asks about */
+void events_init();
+void events_child();
+void watch_process(process_t *p);
+void unwatch_process(process_t *p);
+pid_t poll_job(job_t *j, bool fg);
+void poll_jobs(job_t *first_job);
+pid_t wait_job(job_t *j, job_t *first_job, int read_fd = -1,
+               void (*sink)(const char *data, size_t len) = NULL);
+
+/* Background reaper (reaper.cpp): reaps background processes through their
+ * pidfds on its own thread; the main thread picks up the statuses */
+bool reaper_watch(process_t *p);
+void reaper_forget(pid_t pid);
+bool reaper_active();
+void reaper_collect(process_t *(*find)(pid_t pid));
+void reaper_fork_child();
+int reaper_event_fd();
+
+/* Job table (jobtable.cpp): job_list with O(1) append and removal, and
+ * job number, pgid and pid indexes */
+void jobs_add(job_t *j);
+void jobs_track(job_t *j, process_t *p);
+void jobs_remove(job_t *j);
+job_t *jobs_find_id(int id);
+job_t *jobs_find_pgid(pid_t pgid);
+process_t *jobs_find_pid(pid_t pid);
+job_t *jobs_last();
+job_t *jobs_find_spec(const char *spec);
+void jobs_fork_child();
+
+/* output.log (outputlog.cpp): append-only segments of '~' terminated
+ * entries, indexed by offset for `history N` */
+void log_open();
+void log_output(char *output);
+uint64_t log_entries_begin();
+uint64_t log_entries_end();
+bool log_entry_at(uint64_t seq, std::string *text);
+bool log_entry_text(size_t n, std::string *text);
+void log_fork_child();
+
+/* Persistent history (histstore.cpp): an mmap'd ring of command lines in
+ * ~/.dsh_history shared by every session, each line kept once */
+typedef struct hist_cursor {
+        uint64_t pos;               /* byte position in the ring */
+        ino_t file;                 /* of the file it is a position in; 0 for any */
+} hist_cursor_t;
+
+void hist_open();
+void hist_add(const char *line);
+void hist_foreach(void (*fn)(size_t n, const char *line, void *arg), void *arg);
+bool hist_since(hist_cursor_t *from, bool (*fn)(uint64_t pos, const char *line, void *arg), void *arg);
+bool hist_line_at(uint64_t pos, std::string *line);
+size_t hist_lines();
+void hist_fork_child();
+
+/* History search (search.cpp): history -s over command lines and output.log
+ * entries through trigram indexes kept up to date as both are written */
+void search_open();
+void search_note_command();
+void search_note_output();
+void search_fork_child();
+std::string history_search(const std::string &pattern);
+void history_search_logged(uint64_t seq);
+
+/* Resource accounting (usage.cpp): wait4() rusage and wall clock times per
+ * process, for jobs -v and the time prefix */
+void usage_started(process_t *p);
+void usage_finished(process_t *p, const struct rusage *ru, const struct timespec *ended);
+std::string usage_lines(job_t *j);
+std::string usage_time_report(job_t *j);
+
+/* Resource limits (limits.cpp): ulimit defaults and per-job limit k=v
+ * prefixes, set in each child before exec */
+bool limits_set(job_t *j, const char *spec);
+void limits_merge(job_t *j);
+void limits_apply(unsigned mask, const rlim_t *limit);
+std::string limits_exceeded(job_t *j, process_t *p);
+std::string limits_ulimit(int argc, char **argv);
+
+/* Placement policy (placement.cpp): run --cpus/--nice/--io prefixes and the
+ * place builtin's fg and bg defaults, set in each child before exec */
+int place_option(placement_t *pl, int argc, char **argv);
+void place_merge(job_t *j, bool fg);
+void place_apply(const placement_t *pl, pid_t pid);
+std::string place_builtin(int argc, char **argv);
+
+/* Background job scheduler (sched.cpp): a running job limit, load and CPU
+ * gates, and a priority queue for the jobs held back */
+bool sched_admit();
+void sched_enqueue(job_t *j);
+bool sched_cancel(job_t *j);
+void sched_started(job_t *j);
+void sched_forget(job_t *j);
+bool sched_pending();
+void sched_dispatch();
+void sched_idle(int fd);
+void sched_drain();
+void sched_fork_child();
+void sched_get_limits(int *running, double *load, bool *cpus);
+void sched_set_limits(int running, double load, bool cpus);
+std::string sched_status();
+void spawn_job(job_t *j, bool fg);
+
+/* Parallel for loop (forloop.cpp): each iteration runs in a forked worker
+ * with its own copy of the shell variables and its own output spool, at
+ * most workers at a time, and the output is reported in iteration order */
+void for_parallel(int start, int end, int step, int workers,
+                  void (*iteration)(int value, void *arg), void *arg);
+
+/* Command path hash (pathhash.cpp): name -> absolute path, checked against
+ * PATH and the PATH directories' mtimes */
+const char *path_hash_lookup(const char *name);
+void path_hash_add(const char *name, const char *path);
+void path_hash_clear();
+void path_hash_stats(unsigned long *hits, unsigned long *walks, unsigned *entries);
+std::string path_hash_list(bool reusable);
+
+/* Fast builtins run inside dsh (builtins.cpp).  Output is buffered and
+ * written to fd, or kept in buf when fd is -1. */
+typedef struct fast_out {
+	int fd;
+	bool owns_fd;       /* close fd once the builtin is done */
+	bool broken;        /* the reader went away */
+	std::string buf;
+	fast_out() : fd(-1), owns_fd(false), broken(false) {}
+} fast_out_t;
+
+typedef int (*fast_builtin_fn)(int argc, char **argv, fast_out_t *out);
+
+fast_builtin_fn fast_builtin(const char *name, bool *main_thread);
+int run_fast_builtin(fast_builtin_fn fn, int argc, char **argv, fast_out_t *out);
+void join_stages(job_t *j);
+
 /* Bootstrapping for dsh shell for interactive mode */
 void init_dsh();
 
@@ -108,6 +349,38 @@ int endswith(const char* haystack, const char* needle);
  */
 job_t* readcommandline(const char *commandline);
 
+/* Lexer byte scanners (scan.cpp, SIMD where available): end of the word
+ * starting at i, and end of the run of blanks starting at i */
+size_t scan_word_end(const char *s, size_t i, size_t len);
+size_t scan_blanks_end(const char *s, size_t i, size_t len);
+
+/* The uncached parser behind readcommandline(); takes a line that need not
+ * be NUL terminated.  Errors are appended to *parse_messages instead of
+ * printed while that is set. */
+job_t* parse_commandline(const char *commandline, size_t len);
+extern thread_local std::string *parse_messages;
+void parse_report(const std::string &messages);
+
+/* Batch mode (batch.cpp): lines of a script file are split out of a mapped
+ * (or block read) input and parsed up to BATCH_AHEAD lines ahead on a
+ * helper thread */
+#define BATCH_AHEAD 64
+
+bool batch_open(const char *path);
+bool batch_active();
+job_t *batch_next(bool *eof);
+bool batch_getline(char **line, size_t *len);
+
+/* Parsed-job cache (cache.cpp): LRU of parsed job templates keyed by the
+ * expanded command line */
+#define PARSE_CACHE_SIZE 128
+
+/* Deep copy of a parsed job list into a fresh arena */
+job_t *clone_jobs(const job_t *first_job, size_t text_len);
+
+void parse_cache_stats(unsigned long *hits, unsigned long *misses, unsigned *entries);
+void parse_cache_clear();
+
 job_t* readcmdline(char *msg);
 
 #ifdef NDEBUG
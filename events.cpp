@@ -0,0 +1,296 @@
+#include "dsh.h"
+#include <sys/epoll.h>
+#include <poll.h>
+#include <sys/signalfd.h>
+#include <sys/syscall.h>
+
+/* Child lifecycle events.
+ *
+ * dsh never calls waitpid(WAIT_ANY): that reaps whatever child happens to
+ * change state first, background jobs and the zygote included.  Every
+ * launched process gets a pidfd instead, and waiting on a foreground job is
+ * an epoll over the pidfds of its own processes, a signalfd for SIGCHLD (the
+ * only way to hear about stops, and the fallback on kernels without
+ * pidfd_open), the $(...) pipe dsh reads from it, if any, and the terminal.
+ * Whatever wakes the loop, only the job's own pids are passed to wait4().
+ *
+ * SIGCHLD is blocked from init_dsh() on so the signalfd sees it; the launch
+ * backends unblock it again in the children. */
+
+void print_jobs(bool verbose);
+
+static int sigchld_fd = -1;
+
+/* Block SIGCHLD and open its signalfd; called before any thread exists */
+void events_init()
+{
+    sigset_t set;
+    sigemptyset(&set);
+    sigaddset(&set, SIGCHLD);
+    sigprocmask(SIG_BLOCK, &set, NULL);
+    sigchld_fd = signalfd(-1, &set, SFD_CLOEXEC | SFD_NONBLOCK);
+    if (sigchld_fd < 0)
+    {
+        sigprocmask(SIG_UNBLOCK, &set, NULL);
+    }
+}
+
+/* Undo events_init() in a new child before it execs */
+void events_child()
+{
+    sigset_t set;
+    sigemptyset(&set);
+    sigaddset(&set, SIGCHLD);
+    sigprocmask(SIG_UNBLOCK, &set, NULL);
+}
+
+/* Open a pidfd for the freshly launched p; without one p is only heard of
+ * through SIGCHLD */
+void watch_process(process_t *p)
+{
+#ifdef SYS_pidfd_open
+    p->pidfd = syscall(SYS_pidfd_open, p->pid, 0);
+#else
+    p->pidfd = -1;
+#endif
+}
+
+void unwatch_process(process_t *p)
+{
+    if (p->pidfd >= 0)
+    {
+        close(p->pidfd); /* also drops it from any epoll set */
+        p->pidfd = -1;
+    }
+}
+
+/* Apply a wait4() status and rusage to process p of job j; fg when dsh is
+ * waiting on j in the foreground */
+static void update_process(job_t *j, process_t *p, int status, const struct rusage *ru, bool fg)
+{
+    if (WIFEXITED(status) || WIFSIGNALED(status))
+    {
+        struct timespec now;
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        p->completed = true;
+        p->status = status;
+        usage_finished(p, ru, &now);
+        unwatch_process(p);
+    }
+    else if (WIFSTOPPED(status))
+    {
+        p->stopped = true;
+        if (fg)
+        {
+            if (kill(-j->pgid, SIGSTOP) < 0)
+            {
+                printf("Kill SIGSTOP failed");
+            }
+            j->notified = true;
+            j->bg = true;
+            print_jobs(false);
+        }
+    }
+    else if (WIFCONTINUED(status))
+    {
+        p->stopped = false;
+    }
+}
+
+/* Collect every pending state change of j's processes without blocking.
+ * Returns the last pid that changed, or 0. */
+pid_t poll_job(job_t *j, bool fg)
+{
+    pid_t last = 0;
+    for (process_t *p = j->first_process; p; p = p->next)
+    {
+        if (p->pid <= 0 || p->completed)
+        {
+            continue;
+        }
+        int status;
+        struct rusage ru;
+        pid_t pid;
+        while (!p->completed && (pid = wait4(p->pid, &status, WNOHANG | WUNTRACED | WCONTINUED, &ru)) > 0)
+        {
+            update_process(j, p, status, &ru, fg);
+            last = pid;
+        }
+    }
+    return last;
+}
+
+/* Background jobs are only looked at when someone asks */
+void poll_jobs(job_t *first_job)
+{
+    for (job_t *j = first_job; j; j = j->next)
+    {
+        poll_job(j, false);
+    }
+}
+
+static void drain_sigchld()
+{
+    struct signalfd_siginfo info[8];
+    while (read(sigchld_fd, info, sizeof(info)) > 0)
+        ;
+}
+
+/* The terminal went away: pass the hangup on to every job, like sh does */
+static void hangup(job_t *first_job)
+{
+    for (job_t *j = first_job; j; j = j->next)
+    {
+        if (j->pgid > 0)
+        {
+            kill(-j->pgid, SIGHUP);
+            kill(-j->pgid, SIGCONT);
+        }
+    }
+    exit(128 + SIGHUP);
+}
+
+/* Pass what can be read from fd right now to sink; false once it is at end
+ * of file */
+static bool read_available(int fd, void (*sink)(const char *data, size_t len))
+{
+    char buf[65536];
+    while (1)
+    {
+        ssize_t n = read(fd, buf, sizeof(buf));
+        if (n < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        if (n < 0 && errno == EAGAIN)
+        {
+            return true;
+        }
+        if (n <= 0)
+        {
+            return false;
+        }
+        sink(buf, n);
+    }
+}
+
+/* Wait until every process of the foreground job j has completed or
+ * stopped.  Meanwhile what the job writes to read_fd, when that is not -1,
+ * goes to sink as it comes, so the job never blocks on a full pipe; what is
+ * left in it when the job is done is taken too, but its end of file is not
+ * waited for.  Returns the last pid that changed state, or -1. */
+pid_t wait_job(job_t *j, job_t *first_job, int read_fd, void (*sink)(const char *data, size_t len))
+{
+    static char sigchld_tag, tty_tag, read_tag;
+    int ep = epoll_create1(EPOLL_CLOEXEC);
+    bool pidfds = true; /* every live process has a pidfd */
+    struct epoll_event ev;
+
+    for (process_t *p = j->first_process; p; p = p->next)
+    {
+        if (p->pid <= 0 || p->completed)
+        {
+            continue;
+        }
+        ev.events = EPOLLIN;
+        ev.data.ptr = p;
+        if (ep < 0 || p->pidfd < 0 || epoll_ctl(ep, EPOLL_CTL_ADD, p->pidfd, &ev) < 0)
+        {
+            pidfds = false;
+        }
+    }
+    bool sigchld = false;
+    if (ep >= 0 && sigchld_fd >= 0)
+    {
+        ev.events = EPOLLIN;
+        ev.data.ptr = &sigchld_tag;
+        sigchld = epoll_ctl(ep, EPOLL_CTL_ADD, sigchld_fd, &ev) == 0;
+    }
+    if (ep >= 0 && isatty(STDIN_FILENO))
+    {
+        ev.events = 0; /* hangup and errors only; typeahead is not ours */
+        ev.data.ptr = &tty_tag;
+        epoll_ctl(ep, EPOLL_CTL_ADD, STDIN_FILENO, &ev);
+    }
+    bool reading = read_fd >= 0;
+    if (reading)
+    {
+        fcntl(read_fd, F_SETFL, fcntl(read_fd, F_GETFL) | O_NONBLOCK);
+        ev.events = EPOLLIN;
+        ev.data.ptr = &read_tag;
+        if (ep >= 0)
+        {
+            epoll_ctl(ep, EPOLL_CTL_ADD, read_fd, &ev);
+        }
+    }
+
+    pid_t last = -1;
+    while (1)
+    {
+        pid_t pid = poll_job(j, true);
+        if (pid > 0)
+        {
+            last = pid;
+        }
+        if (job_is_stopped(j))
+        {
+            break;
+        }
+        else if (!sigchld && !pidfds && reading)
+        {
+            /* nothing to sleep on, and the pipe must keep moving: look at
+             * it and at the job in turn */
+            struct pollfd pfd = {read_fd, POLLIN, 0};
+            if (poll(&pfd, 1, 10) > 0)
+            {
+                reading = read_available(read_fd, sink);
+            }
+            continue;
+        }
+        else if (!sigchld && !pidfds)
+        {
+            /* nothing to sleep on: block on the job's first live process */
+            for (process_t *p = j->first_process; p; p = p->next)
+            {
+                int status;
+                struct rusage ru;
+                if (p->pid > 0 && !p->completed && wait4(p->pid, &status, WUNTRACED, &ru) > 0)
+                {
+                    update_process(j, p, status, &ru, true);
+                    last = p->pid;
+                    break;
+                }
+            }
+            continue;
+        }
+
+        struct epoll_event events[8];
+        int n = epoll_wait(ep, events, 8, -1);
+        for (int i = 0; i < n; i++)
+        {
+            if (events[i].data.ptr == &sigchld_tag)
+            {
+                drain_sigchld();
+            }
+            else if (events[i].data.ptr == &tty_tag)
+            {
+                hangup(first_job);
+            }
+            else if (events[i].data.ptr == &read_tag && !read_available(read_fd, sink))
+            {
+                epoll_ctl(ep, EPOLL_CTL_DEL, read_fd, NULL);
+                reading = false;
+            }
+            /* pidfds only need to wake us up */
+        }
+    }
+    if (reading)
+    {
+        read_available(read_fd, sink);
+    }
+    if (ep >= 0)
+    {
+        close(ep);
+    }
+    return last;
+}
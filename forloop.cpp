@@ -0,0 +1,238 @@
+#include "dsh.h"
+#include <sys/epoll.h>
+#include <sys/syscall.h>
+#include <vector>
+
+using namespace std;
+
+extern int dsh_is_interactive;
+
+/* Parallel for loop: for VAR in {a..b..step} -P N.
+ *
+ * The shell mode interprets a loop body inside dsh itself, variables and
+ * all, so an iteration cannot simply be a job.  Each iteration is a fork of
+ * dsh instead, a worker that runs the body once and exits: it gets its own
+ * copy of the variables for free, and what it prints, its commands'
+ * output included, is spooled to an unnamed temporary file, however much
+ * there is.  At most N workers run at once.  dsh waits on their pidfds and
+ * copies the spools out strictly in iteration order, each as soon as its
+ * worker has exited and every earlier iteration has been printed.
+ *
+ * A worker is a fork of a threaded process, so it only keeps what works
+ * without the other threads: no capture or reaper thread, no zygote (its
+ * children would be dsh's), and none of dsh's jobs. */
+
+struct iteration
+{
+    int value;
+    pid_t pid;              /* worker, or -1 once it is reaped */
+    int pidfd;
+    int spool;              /* its stdout, or -1 when it writes to dsh's */
+    bool done;
+};
+
+static void worker_main(int value, int out_fd, void (*body)(int, void *), void *arg)
+{
+    if (out_fd >= 0)
+    {
+        dup2(out_fd, STDOUT_FILENO);
+    }
+    /* iterations share no terminal: nothing reads it or takes it over */
+    int null_fd = open("/dev/null", O_RDONLY);
+    if (null_fd >= 0)
+    {
+        dup2(null_fd, STDIN_FILENO);
+        close(null_fd);
+    }
+    dsh_is_interactive = 0;
+    capture_fork_child();
+    reaper_fork_child();
+    jobs_fork_child();
+    sched_fork_child();
+    log_fork_child();
+    hist_fork_child();
+    search_fork_child();
+    if (spawn_backend == SPAWN_ZYGOTE)
+    {
+        spawn_backend = SPAWN_FORK;
+    }
+
+    body(value, arg);
+    fflush(stdout);
+    _exit(EXIT_SUCCESS);
+}
+
+/* An unnamed file to spool a worker's output to, or -1 */
+static int open_spool()
+{
+    const char *dir = getenv("TMPDIR");
+    if (!dir || !*dir)
+    {
+        dir = "/tmp";
+    }
+#ifdef O_TMPFILE
+    int fd = open(dir, O_TMPFILE | O_RDWR | O_CLOEXEC, 0600);
+    if (fd >= 0)
+    {
+        return fd;
+    }
+#endif
+    /* no O_TMPFILE on this file system: a named one, unlinked at once */
+    string name = string(dir) + "/dsh-for.XXXXXX";
+    int tmp = mkostemp(&name[0], O_CLOEXEC);
+    if (tmp >= 0)
+    {
+        unlink(name.c_str());
+    }
+    return tmp;
+}
+
+/* Fork the worker for it; false when no process could be created */
+static bool start_worker(iteration &it, int ep, void (*body)(int, void *), void *arg)
+{
+    it.spool = open_spool();
+    fflush(stdout); /* or the worker prints dsh's pending output again */
+    it.pid = fork();
+    if (it.pid < 0)
+    {
+        if (it.spool >= 0)
+        {
+            close(it.spool);
+            it.spool = -1;
+        }
+        return false;
+    }
+    if (it.pid == 0)
+    {
+        worker_main(it.value, it.spool, body, arg);
+    }
+#ifdef SYS_pidfd_open
+    it.pidfd = syscall(SYS_pidfd_open, it.pid, 0);
+#else
+    it.pidfd = -1;
+#endif
+    struct epoll_event ev;
+    ev.events = EPOLLIN;
+    ev.data.ptr = &it;
+    if (it.pidfd >= 0 && epoll_ctl(ep, EPOLL_CTL_ADD, it.pidfd, &ev) < 0)
+    {
+        close(it.pidfd);
+        it.pidfd = -1;
+    }
+    return true;
+}
+
+static void reap_worker(iteration &it, int ep)
+{
+    int status;
+    while (waitpid(it.pid, &status, 0) < 0 && errno == EINTR)
+        ;
+    if (it.pidfd >= 0)
+    {
+        /* workers forked later hold copies of the pidfd, so closing it
+         * would not take it out of the epoll set */
+        epoll_ctl(ep, EPOLL_CTL_DEL, it.pidfd, NULL);
+        close(it.pidfd);
+        it.pidfd = -1;
+    }
+    it.pid = -1;
+    it.done = true;
+}
+
+/* Copy out what the worker spooled.  Its worker has exited; anything it
+ * left running in the background and still writing is cut off here. */
+static void report_iteration(iteration &it)
+{
+    if (it.spool < 0)
+    {
+        return;
+    }
+    char buf[65536];
+    off_t at = 0;
+    ssize_t n;
+    while ((n = pread(it.spool, buf, sizeof(buf), at)) > 0 || (n < 0 && errno == EINTR))
+    {
+        if (n > 0)
+        {
+            fwrite(buf, 1, n, stdout);
+            at += n;
+        }
+    }
+    fflush(stdout);
+    close(it.spool);
+    it.spool = -1;
+}
+
+void for_parallel(int start, int end, int step, int workers,
+                  void (*iteration_fn)(int value, void *arg), void *arg)
+{
+    vector<iteration> its;
+    for (long v = start; step > 0 && v <= end; v += step)
+    {
+        its.push_back(iteration{(int)v, -1, -1, -1, false});
+    }
+    int ep = epoll_create1(EPOLL_CLOEXEC);
+    size_t next = 0;      /* first iteration not started */
+    size_t reported = 0;  /* first iteration not printed */
+    int running = 0;
+
+    while (reported < its.size())
+    {
+        while (reported < next && its[reported].done)
+        {
+            report_iteration(its[reported++]);
+        }
+        while (running < workers && next < its.size())
+        {
+            iteration &it = its[next];
+            if (ep < 0 || !start_worker(it, ep, iteration_fn, arg))
+            {
+                if (running)
+                {
+                    break; /* try again once a worker has finished */
+                }
+                /* everything before it is printed: run it in place */
+                iteration_fn(it.value, arg);
+                fflush(stdout);
+                it.done = true;
+                if (reported == next)
+                {
+                    reported++;
+                }
+                next++;
+                continue;
+            }
+            running++;
+            next++;
+        }
+        if (!running)
+        {
+            continue;
+        }
+
+        /* wait for any worker; without pidfds, for the oldest */
+        struct epoll_event events[16];
+        int n = ep >= 0 ? epoll_wait(ep, events, 16, its[reported].pidfd >= 0 || its[reported].done ? -1 : 0) : 0;
+        for (int i = 0; i < n; i++)
+        {
+            reap_worker(*(iteration *)events[i].data.ptr, ep);
+            running--;
+        }
+        if (n <= 0)
+        {
+            for (size_t i = reported; i < next; i++)
+            {
+                if (!its[i].done && its[i].pidfd < 0)
+                {
+                    reap_worker(its[i], ep);
+                    running--;
+                    break;
+                }
+            }
+        }
+    }
+    if (ep >= 0)
+    {
+        close(ep);
+    }
+}
@@ -47,22 +47,19 @@ job_t *detach_job(job_t *first_job)
 	return NULL;
 }
 
-/* free_job iterates and invokes free on all its members */
+/* free_job drops the job's reference on the arena it was parsed into; the
+ * job, its processes and all their strings live there.  Its output capture
+ * goes too, and it first waits for any fast builtin stage still using them. */
 bool free_job(job_t *j) 
 {
 	if(!j)
 		return true;
-	free(j->commandinfo);
-	process_t *p;
-	for(p = j->first_process; p; p = p->next) {
-		int i;
-		for(i = 0; i < p->argc; i++)
-			free(p->argv[i]);
-		free(p->argv);
-        	free(p->ifile);
-        	free(p->ofile);
-	}
-	free(j);
+	join_stages(j);
+	capture_release(j->capture);
+	j->capture = NULL;
+	for(process_t *p = j->first_process; p; p = p->next)
+		unwatch_process(p);
+	arena_release(j->arena);
 	return true;
 }
 
@@ -157,6 +154,17 @@ void init_dsh()
 		}
 		seize_tty(dsh_pgid);
 	} 
+
+	/* a fast builtin writing into a closed pipe must fail with EPIPE
+	 * rather than take dsh down; new_child() restores it for children */
+	signal(SIGPIPE, SIG_IGN);
+
+	/* SIGCHLD goes to a signalfd; blocked before any thread starts */
+	events_init();
+
+	/* start the launch helper now, not on the first launch */
+	if(spawn_backend == SPAWN_ZYGOTE)
+		zygote_start();
 }
 
 /* Prints the jobs in the list.  */
@@ -167,10 +175,12 @@ void print_job(job_t *first_job)
 	for(j = first_job; j; j = j->next) {
         	fprintf(stdout, "\n#DISPLAY JOB INFO BEGIN#\njob: %ld, %s\n", (long)j->pgid, j->commandinfo);
 		for(p = j->first_process; p; p = p->next) {
-			fprintf(stdout,"cmd: %s\t", p->argv[0]);
+			char **argv = process_argv(j, p);
+			if(!argv) continue;
+			fprintf(stdout,"cmd: %s\t", argv[0]);
 			int i;
 			for(i = 1; i < p->argc; i++) {
-				fprintf(stdout, "%s ", p->argv[i]);
+				fprintf(stdout, "%s ", argv[i]);
 			}
 			fprintf(stdout, "\n");
 			fprintf(stdout, "Status: %d, Completed: %d, Stopped: %d\n", p->status, p->completed, p->stopped);
@@ -0,0 +1,561 @@
+#include "dsh.h"
+#include <pthread.h>
+#include <stdint.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <string>
+
+using namespace std;
+
+/* Persistent command history: ~/.dsh_history, or $DSH_HISTFILE.
+ *
+ * The file is mmap'd whole at startup and never read through or parsed, so
+ * opening it costs the same with ten entries or millions.  After a header
+ * page it holds a ring of records, oldest at tail and newest just before
+ * head, and an open addressing index of the records by the hash of their
+ * line.  Positions count bytes ever written, so a position below tail is
+ * a record the ring has since written over.
+ *
+ *   record:  u32 size | flags, u32 hash, the line, NUL, padding to 8 bytes
+ *   slot:    (position / 8 + 1) << 24 | top 24 bits of the hash; 0 is empty
+ *
+ * Adding a line is O(1): it is written at head, tail moves past whatever it
+ * overwrites, and an earlier copy of the same line, found through the
+ * index, is marked erased so every line is kept once, at its latest use.
+ * Slots of records that were overwritten or erased are reused; once three
+ * quarters of the slots have been filled the index is rebuilt from the
+ * ring, which keeps probes short at an amortized O(1).
+ *
+ * Sessions append to the same file under flock().  $DSH_HISTSIZE sets how
+ * many lines of 64 bytes fit in the ring (10000 by default); a file made
+ * for another size is copied into one of the new size once, at startup.
+ * A session that finds the file replaced later on adopts whatever size it
+ * has, or two sessions with different sizes would copy it back and forth
+ * on every command.
+ *
+ * flock() is shared by the threads of a session, so they also take
+ * store_mutex: the search indexes what the file held at startup on a
+ * thread of its own (search.cpp). */
+
+#define HIST_VERSION 1
+#define HIST_HEADER 4096
+#define HIST_ERASED 1           /* a later copy of the line exists */
+#define HIST_PAD 2              /* filler up to the end of the ring */
+
+struct hist_header
+{
+    char magic[8];              /* "DSHHIST" */
+    uint32_t version;
+    uint32_t reserved;
+    uint64_t capacity;          /* bytes of the ring, a multiple of 8 */
+    uint64_t slots;             /* of the index, a power of two */
+    uint64_t head;              /* position after the newest record */
+    uint64_t tail;              /* position of the oldest record kept */
+    uint64_t used;              /* slots filled since the index was built */
+    uint64_t lines;             /* records kept and not erased */
+};
+
+static int hist_fd = -1;
+static ino_t hist_ino;
+static hist_header *hdr = NULL;
+static char *ring;
+static uint64_t *slots;
+static size_t map_len;
+static string hist_path;
+static uint64_t want_capacity;
+static pthread_mutex_t store_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static uint32_t line_hash(const char *s, size_t len)
+{
+    uint32_t h = 2166136261u; /* FNV-1a */
+    for (size_t i = 0; i < len; i++)
+    {
+        h = (h ^ (unsigned char)s[i]) * 16777619u;
+    }
+    return h;
+}
+
+static uint32_t *record_at(uint64_t pos)
+{
+    return (uint32_t *)(ring + pos % hdr->capacity);
+}
+
+/* Size of the record at pos in a ring of capacity bytes that ends at head,
+ * or 0 when it cannot be one: a file damaged from outside would otherwise
+ * send the walks around it forever, or past the end of the map */
+static uint64_t checked_size(const char *r, uint64_t capacity, uint64_t pos, uint64_t head)
+{
+    uint32_t word = *(const uint32_t *)(r + pos % capacity);
+    uint64_t size = word & ~7u;
+    if (size < 8 || size > capacity - pos % capacity || size > head - pos)
+    {
+        return 0;
+    }
+    if (!(word & HIST_PAD) && (size < 16 || r[pos % capacity + size - 1]))
+    {
+        return 0; /* no room for the hash and a line, or no NUL */
+    }
+    return size;
+}
+
+static uint64_t record_size(uint64_t pos)
+{
+    return checked_size(ring, hdr->capacity, pos, hdr->head);
+}
+
+/* The record at pos is still in the ring and not erased */
+static bool record_live(uint64_t pos)
+{
+    return pos >= hdr->tail && pos < hdr->head && record_size(pos) &&
+           !(*record_at(pos) & (HIST_ERASED | HIST_PAD));
+}
+
+static uint64_t slot_pos(uint64_t slot)
+{
+    return ((slot >> 24) - 1) * 8;
+}
+
+static bool slot_live(uint64_t slot)
+{
+    return slot && record_live(slot_pos(slot));
+}
+
+/* Put the record at pos into the first slot along its probe sequence that
+ * is empty or stale */
+static void index_insert(uint64_t pos, uint32_t hash)
+{
+    uint64_t mask = hdr->slots - 1;
+    for (uint64_t i = hash & mask;; i = (i + 1) & mask)
+    {
+        if (!slot_live(slots[i]))
+        {
+            hdr->used += !slots[i];
+            slots[i] = ((pos / 8 + 1) << 24) | (hash >> 8);
+            return;
+        }
+    }
+}
+
+static void index_rebuild()
+{
+    memset(slots, 0, hdr->slots * sizeof(uint64_t));
+    hdr->used = 0;
+    for (uint64_t pos = hdr->tail, size; pos < hdr->head && (size = record_size(pos)); pos += size)
+    {
+        if (record_live(pos))
+        {
+            index_insert(pos, record_at(pos)[1]);
+        }
+    }
+}
+
+/* Slot of the live record holding line, or NULL */
+static uint64_t *index_find(const char *line, uint32_t hash)
+{
+    uint64_t mask = hdr->slots - 1;
+    for (uint64_t i = hash & mask, n = 0; slots[i] && n < hdr->slots; i = (i + 1) & mask, n++)
+    {
+        if ((slots[i] & 0xffffff) == (hash >> 8) && slot_live(slots[i]))
+        {
+            uint32_t *r = record_at(slot_pos(slots[i]));
+            if (r[1] == hash && !strcmp((char *)(r + 2), line))
+            {
+                return &slots[i];
+            }
+        }
+    }
+    return NULL;
+}
+
+/* Move tail past every record that a write up to position end overwrites */
+static void make_room(uint64_t end)
+{
+    while (hdr->tail < hdr->head && hdr->tail + hdr->capacity < end)
+    {
+        uint64_t size = record_size(hdr->tail);
+        if (!size)
+        {
+            hdr->tail = hdr->head; /* damaged: what is left is lost */
+            hdr->lines = 0;
+            break;
+        }
+        if (record_live(hdr->tail))
+        {
+            hdr->lines--;
+        }
+        hdr->tail += size;
+    }
+}
+
+/* Write line as the newest record; the caller holds the lock */
+static void append_record(const char *line, size_t len, uint32_t hash)
+{
+    uint64_t size = (8 + len + 1 + 7) & ~(uint64_t)7;
+    if (size > hdr->capacity / 4)
+    {
+        return; /* not worth the history it would push out */
+    }
+    uint64_t *dup = index_find(line, hash);
+    if (dup)
+    {
+        *record_at(slot_pos(*dup)) |= HIST_ERASED;
+        hdr->lines--;
+    }
+    uint64_t room = hdr->capacity - hdr->head % hdr->capacity;
+    if (room < size)
+    {
+        /* records never wrap: fill the end of the ring and start over */
+        make_room(hdr->head + room);
+        *record_at(hdr->head) = (uint32_t)room | HIST_PAD;
+        hdr->head += room;
+    }
+    make_room(hdr->head + size);
+    uint32_t *r = record_at(hdr->head);
+    r[1] = hash;
+    memcpy(r + 2, line, len);
+    memset((char *)(r + 2) + len, 0, size - 8 - len);
+    r[0] = (uint32_t)size;
+    uint64_t pos = hdr->head;
+    hdr->head += size;
+    hdr->lines++;
+    if (dup)
+    {
+        *dup = ((pos / 8 + 1) << 24) | (hash >> 8);
+    }
+    else
+    {
+        index_insert(pos, hash);
+        if (hdr->used > hdr->slots / 4 * 3)
+        {
+            index_rebuild();
+        }
+    }
+}
+
+static void unmap()
+{
+    if (hdr)
+    {
+        munmap(hdr, map_len);
+        hdr = NULL;
+    }
+    if (hist_fd >= 0)
+    {
+        close(hist_fd);
+        hist_fd = -1;
+    }
+}
+
+static bool map_fd(int fd, size_t len)
+{
+    void *m = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (m == MAP_FAILED)
+    {
+        return false;
+    }
+    hdr = (hist_header *)m;
+    map_len = len;
+    ring = (char *)m + HIST_HEADER;
+    slots = (uint64_t *)(ring + hdr->capacity);
+    return true;
+}
+
+static size_t file_size(uint64_t capacity, uint64_t nslots)
+{
+    return HIST_HEADER + capacity + nslots * sizeof(uint64_t);
+}
+
+/* Make fd an empty store of want_capacity bytes and map it */
+static bool format(int fd)
+{
+    uint64_t nslots = 1;
+    while (nslots < want_capacity / 8) /* every record takes 16 bytes or more */
+    {
+        nslots <<= 1;
+    }
+    size_t len = file_size(want_capacity, nslots);
+    if (ftruncate(fd, 0) < 0 || ftruncate(fd, len) < 0)
+    {
+        return false;
+    }
+    hist_header h;
+    memset(&h, 0, sizeof(h));
+    memcpy(h.magic, "DSHHIST", 8);
+    h.version = HIST_VERSION;
+    h.capacity = want_capacity;
+    h.slots = nslots;
+    if (pwrite(fd, &h, sizeof(h), 0) != sizeof(h))
+    {
+        return false;
+    }
+    return map_fd(fd, len);
+}
+
+/* Is the file behind fd, len bytes long, a store this dsh can use?  Its
+ * header goes to h. */
+static bool valid(int fd, size_t len, hist_header *h)
+{
+    if (len < HIST_HEADER || pread(fd, h, sizeof(*h), 0) != sizeof(*h))
+    {
+        return false;
+    }
+    return !memcmp(h->magic, "DSHHIST", 8) && h->version == HIST_VERSION &&
+           h->capacity && h->capacity % 8 == 0 && h->slots && !(h->slots & (h->slots - 1)) &&
+           len == file_size(h->capacity, h->slots) && h->tail % 8 == 0 && h->head % 8 == 0 &&
+           h->tail <= h->head && h->head - h->tail <= h->capacity;
+}
+
+/* The store in old_fd was made for another size: copy its lines, oldest
+ * first, into a new file of the configured size that replaces it.  Returns
+ * the new file, mapped and locked, or -1. */
+static int resize(int old_fd, size_t old_len)
+{
+    string tmp = hist_path + ".tmp";
+    int fd = open(tmp.c_str(), O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+    if (fd < 0)
+    {
+        return -1;
+    }
+    if (!map_fd(old_fd, old_len))
+    {
+        close(fd);
+        unlink(tmp.c_str());
+        return -1;
+    }
+    hist_header *old = hdr;
+    char *old_ring = ring;
+    if (!format(fd))
+    {
+        munmap(old, old_len);
+        hdr = NULL;
+        close(fd);
+        unlink(tmp.c_str());
+        return -1;
+    }
+    for (uint64_t pos = old->tail, size;
+         pos < old->head && (size = checked_size(old_ring, old->capacity, pos, old->head)); pos += size)
+    {
+        uint32_t *r = (uint32_t *)(old_ring + pos % old->capacity);
+        if (!(r[0] & (HIST_ERASED | HIST_PAD)))
+        {
+            const char *line = (char *)(r + 2);
+            append_record(line, strlen(line), r[1]);
+        }
+    }
+    munmap(old, old_len);
+    flock(fd, LOCK_EX);
+    rename(tmp.c_str(), hist_path.c_str());
+    return fd;
+}
+
+/* Open and map hist_path, creating it as needed and, at startup only,
+ * resizing it; returns with the file locked */
+static bool map_store(bool startup)
+{
+    for (int attempt = 0; attempt < 3; attempt++)
+    {
+        int fd = open(hist_path.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+        if (fd < 0)
+        {
+            return false;
+        }
+        flock(fd, LOCK_EX);
+        struct stat st, path_st;
+        if (fstat(fd, &st) < 0 || stat(hist_path.c_str(), &path_st) < 0 || st.st_ino != path_st.st_ino)
+        {
+            close(fd); /* replaced by another session while we waited */
+            continue;
+        }
+        hist_header h;
+        int store = fd;
+        bool ok;
+        if (!valid(fd, st.st_size, &h))
+        {
+            ok = format(fd); /* new, or not a store at all: start over */
+        }
+        else if (startup && h.capacity != want_capacity && (store = resize(fd, st.st_size)) >= 0)
+        {
+            ok = true;
+            close(fd);
+        }
+        else
+        {
+            store = fd;
+            ok = map_fd(fd, st.st_size);
+        }
+        if (!ok)
+        {
+            close(fd);
+            hdr = NULL;
+            return false;
+        }
+        hist_fd = store;
+        fstat(store, &st);
+        hist_ino = st.st_ino;
+        return true;
+    }
+    return false;
+}
+
+/* Lock the store for a change; it is mapped again first when another
+ * session has replaced the file */
+static bool lock_store()
+{
+    pthread_mutex_lock(&store_mutex);
+    if (!hdr)
+    {
+        pthread_mutex_unlock(&store_mutex);
+        return false;
+    }
+    flock(hist_fd, LOCK_EX);
+    struct stat st;
+    if (stat(hist_path.c_str(), &st) == 0 && st.st_ino != hist_ino)
+    {
+        unmap();
+        if (!map_store(false))
+        {
+            pthread_mutex_unlock(&store_mutex);
+            return false;
+        }
+    }
+    return true;
+}
+
+/* Lock the store for reading; the mapping stays as it is */
+static bool share_store()
+{
+    pthread_mutex_lock(&store_mutex);
+    if (!hdr)
+    {
+        pthread_mutex_unlock(&store_mutex);
+        return false;
+    }
+    flock(hist_fd, LOCK_SH);
+    return true;
+}
+
+static void unlock_store()
+{
+    flock(hist_fd, LOCK_UN);
+    pthread_mutex_unlock(&store_mutex);
+}
+
+/* At startup: map the history file; without one, history is not kept */
+void hist_open()
+{
+    const char *path = getenv("DSH_HISTFILE");
+    const char *home = getenv("HOME");
+    if (path && *path)
+    {
+        hist_path = path;
+    }
+    else if (home && *home)
+    {
+        hist_path = string(home) + "/.dsh_history";
+    }
+    else
+    {
+        return;
+    }
+    long lines = getenv("DSH_HISTSIZE") ? atol(getenv("DSH_HISTSIZE")) : 0;
+    if (lines <= 0)
+    {
+        lines = 10000;
+    }
+    want_capacity = ((uint64_t)lines * 64 + 4095) & ~(uint64_t)4095;
+    pthread_mutex_lock(&store_mutex);
+    if (map_store(true))
+    {
+        unlock_store();
+    }
+    else
+    {
+        pthread_mutex_unlock(&store_mutex);
+    }
+}
+
+/* Record a command line; an earlier copy of it is dropped */
+void hist_add(const char *line)
+{
+    size_t len = strlen(line);
+    if (!len || !lock_store())
+    {
+        return;
+    }
+    append_record(line, len, line_hash(line, len));
+    unlock_store();
+    search_note_command();
+}
+
+/* Every line kept, oldest first, with its number (1: the oldest) */
+void hist_foreach(void (*fn)(size_t n, const char *line, void *arg), void *arg)
+{
+    if (!share_store())
+    {
+        return;
+    }
+    size_t n = 0;
+    for (uint64_t pos = hdr->tail, size; pos < hdr->head && (size = record_size(pos)); pos += size)
+    {
+        if (record_live(pos))
+        {
+            fn(++n, (char *)(record_at(pos) + 2), arg);
+        }
+    }
+    unlock_store();
+}
+
+/* Every line kept at or past from, oldest first, with its position, until
+ * fn returns false; from moves on to the line fn turned down, or past the
+ * newest.  Without fn it only moves past the newest.  False, with nothing
+ * listed, when the file was replaced since from was: positions start over. */
+bool hist_since(hist_cursor_t *from, bool (*fn)(uint64_t pos, const char *line, void *arg), void *arg)
+{
+    if (!share_store())
+    {
+        return true;
+    }
+    bool ok = (!from->file || from->file == hist_ino) && from->pos <= hdr->head;
+    from->file = hist_ino;
+    if (ok)
+    {
+        uint64_t pos = from->pos > hdr->tail ? from->pos : hdr->tail;
+        for (uint64_t size; pos < hdr->head && (size = record_size(pos)); pos += size)
+        {
+            if (fn && record_live(pos) && !fn(pos, (char *)(record_at(pos) + 2), arg))
+            {
+                break;
+            }
+        }
+        from->pos = pos < hdr->head ? pos : hdr->head;
+    }
+    unlock_store();
+    return ok;
+}
+
+/* The line at position pos, if it is still kept and not erased */
+bool hist_line_at(uint64_t pos, string *line)
+{
+    if (!share_store())
+    {
+        return false;
+    }
+    bool live = record_live(pos);
+    if (live)
+    {
+        *line = (char *)(record_at(pos) + 2);
+    }
+    unlock_store();
+    return live;
+}
+
+size_t hist_lines()
+{
+    return hdr ? hdr->lines : 0;
+}
+
+/* In a forked worker: a thread that held store_mutex at the fork is gone */
+void hist_fork_child()
+{
+    pthread_mutex_init(&store_mutex, NULL);
+}
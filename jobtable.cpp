@@ -0,0 +1,158 @@
+#include "dsh.h"
+#include <unordered_map>
+
+using namespace std;
+
+/* Job table.  job_list stays the list `jobs` walks, oldest job first, but it
+ * is doubly linked with a tail pointer so a job is appended and unlinked in
+ * O(1), and three hash maps answer the lookups that used to walk it: job
+ * number -> job, pgid -> job and pid -> process.
+ *
+ * Job numbers are stable: a job keeps the number it was given at launch
+ * until it is removed, whatever finishes before it.  Like sh, a new job
+ * gets one more than the newest job still in the table, so numbers start
+ * over from 1 once every job is gone. */
+
+extern job_t *job_list;
+
+static job_t *job_tail = NULL;
+static unordered_map<int, job_t *> by_id;
+static unordered_map<pid_t, job_t *> by_pgid;
+static unordered_map<pid_t, process_t *> by_pid;
+
+/* Append j to job_list and give it the next job number */
+void jobs_add(job_t *j)
+{
+    j->id = job_tail ? job_tail->id + 1 : 1;
+    j->prev = job_tail;
+    j->next = NULL;
+    if (job_tail)
+    {
+        job_tail->next = j;
+    }
+    else
+    {
+        job_list = j;
+    }
+    job_tail = j;
+    by_id[j->id] = j;
+}
+
+/* Index p, just launched as part of j, by its pid and j by its pgid.  A
+ * process still listed under the same pid has exited, or the kernel would
+ * not have reused it, but the reaper may not have handed its exit over yet:
+ * that is done first.  An entry still live after it is never overwritten. */
+void jobs_track(job_t *j, process_t *p)
+{
+    if (p->pid > 0)
+    {
+        auto it = by_pid.find(p->pid);
+        if (it != by_pid.end() && it->second != p && !it->second->completed)
+        {
+            reaper_collect(jobs_find_pid);
+        }
+        if (it == by_pid.end())
+        {
+            by_pid[p->pid] = p;
+        }
+        else if (it->second->completed)
+        {
+            it->second = p;
+        }
+    }
+    if (j->pgid > 0)
+    {
+        by_pgid[j->pgid] = j;
+    }
+}
+
+/* Unlink j from job_list and every index; j itself is left to free_job() */
+void jobs_remove(job_t *j)
+{
+    if (j->prev)
+    {
+        j->prev->next = j->next;
+    }
+    else if (job_list == j)
+    {
+        job_list = j->next;
+    }
+    if (j->next)
+    {
+        j->next->prev = j->prev;
+    }
+    else if (job_tail == j)
+    {
+        job_tail = j->prev;
+    }
+    j->next = j->prev = NULL;
+
+    by_id.erase(j->id);
+    auto g = by_pgid.find(j->pgid);
+    if (g != by_pgid.end() && g->second == j)
+    {
+        by_pgid.erase(g);
+    }
+    for (process_t *p = j->first_process; p; p = p->next)
+    {
+        auto it = by_pid.find(p->pid);
+        if (it != by_pid.end() && it->second == p)
+        {
+            by_pid.erase(it);
+        }
+    }
+}
+
+/* In a forked worker: the jobs listed are dsh's, not the worker's.  They
+ * are forgotten, not freed; their captures belong to dsh. */
+void jobs_fork_child()
+{
+    job_list = job_tail = NULL;
+    by_id.clear();
+    by_pgid.clear();
+    by_pid.clear();
+}
+
+job_t *jobs_find_id(int id)
+{
+    auto it = by_id.find(id);
+    return it == by_id.end() ? NULL : it->second;
+}
+
+job_t *jobs_find_pgid(pid_t pgid)
+{
+    auto it = by_pgid.find(pgid);
+    return it == by_pgid.end() ? NULL : it->second;
+}
+
+process_t *jobs_find_pid(pid_t pid)
+{
+    auto it = by_pid.find(pid);
+    return it == by_pid.end() ? NULL : it->second;
+}
+
+job_t *jobs_last()
+{
+    return job_tail;
+}
+
+/* Job named by a jobspec: %N or plain N for job number N, and %%, %+ or an
+ * empty spec for the newest job.  NULL when there is no such job. */
+job_t *jobs_find_spec(const char *spec)
+{
+    if (spec[0] == '%')
+    {
+        spec++;
+    }
+    if (!*spec || !strcmp(spec, "%") || !strcmp(spec, "+"))
+    {
+        return job_tail;
+    }
+    char *end;
+    long id = strtol(spec, &end, 10);
+    if (*end || id <= 0)
+    {
+        return NULL;
+    }
+    return jobs_find_id((int)id);
+}
@@ -0,0 +1,258 @@
+#include "dsh.h"
+#include <string>
+
+using namespace std;
+
+/* Resource limits for jobs.  ulimit sets shell-wide defaults, and a job can
+ * override them with a prefix: limit cpu=10 as=2G -- cmd.  dsh never limits
+ * itself; a job's limits are merged from both when it is launched and set
+ * with setrlimit() in each of its processes right before exec.  A process
+ * that dies of one of them is reported with the limit it ran into. */
+
+struct limit_kind
+{
+    const char *name;       /* in limit name=value and ulimit name=value */
+    char flag;              /* ulimit -flag value */
+    int resource;
+    rlim_t unit;            /* what a bare number counts */
+    const char *what;
+};
+
+/* indexed like job_t.limit */
+static const limit_kind kinds[LIMIT_KINDS] = {
+    {"cpu",     't', RLIMIT_CPU,     1,    "cpu time (seconds)"},
+    {"as",      'v', RLIMIT_AS,      1024, "virtual memory (kbytes)"},
+    {"data",    'd', RLIMIT_DATA,    1024, "data seg size (kbytes)"},
+    {"stack",   's', RLIMIT_STACK,   1024, "stack size (kbytes)"},
+    {"fsize",   'f', RLIMIT_FSIZE,   1024, "file size (kbytes)"},
+    {"core",    'c', RLIMIT_CORE,    1024, "core file size (kbytes)"},
+    {"nofile",  'n', RLIMIT_NOFILE,  1,    "open files"},
+    {"nproc",   'u', RLIMIT_NPROC,   1,    "max user processes"},
+    {"memlock", 'l', RLIMIT_MEMLOCK, 1024, "max locked memory (kbytes)"},
+};
+
+#define LIMIT_CPU   0
+#define LIMIT_FSIZE 4
+
+static unsigned default_mask = 0;
+static rlim_t default_limit[LIMIT_KINDS];
+
+/* "10", "2G", "512k" or "unlimited" for kind k; false when malformed */
+static bool parse_value(int k, const char *s, rlim_t *value)
+{
+    if (!strcmp(s, "unlimited"))
+    {
+        *value = RLIM_INFINITY;
+        return true;
+    }
+    char *end;
+    unsigned long long n = strtoull(s, &end, 10);
+    if (end == s)
+    {
+        return false;
+    }
+    if (!*end)
+    {
+        *value = n * kinds[k].unit;
+        return true;
+    }
+    /* K, M, G and T are bytes, for the limits measured in bytes */
+    const char *suffixes = "KMGT";
+    const char *at = strchr(suffixes, toupper((unsigned char)*end));
+    if (!at || end[1] || kinds[k].unit == 1)
+    {
+        return false;
+    }
+    *value = n << (10 * (at - suffixes + 1));
+    return true;
+}
+
+static int find_kind(const char *name, size_t len)
+{
+    for (int k = 0; k < LIMIT_KINDS; k++)
+    {
+        if (strlen(kinds[k].name) == len && !strncmp(kinds[k].name, name, len))
+        {
+            return k;
+        }
+    }
+    return -1;
+}
+
+/* name=value into j's own limits; false when spec is not one */
+bool limits_set(job_t *j, const char *spec)
+{
+    const char *eq = strchr(spec, '=');
+    int k = eq ? find_kind(spec, eq - spec) : -1;
+    rlim_t value;
+    if (k < 0 || !parse_value(k, eq + 1, &value))
+    {
+        return false;
+    }
+    j->limit[k] = value;
+    j->limit_mask |= 1u << k;
+    return true;
+}
+
+/* Give j the shell-wide defaults for every limit it does not set itself */
+void limits_merge(job_t *j)
+{
+    for (int k = 0; k < LIMIT_KINDS; k++)
+    {
+        if ((default_mask & (1u << k)) && !(j->limit_mask & (1u << k)))
+        {
+            j->limit[k] = default_limit[k];
+            j->limit_mask |= 1u << k;
+        }
+    }
+}
+
+/* In a new child, before exec: only async-signal-safe calls.  A soft limit
+ * above the hard one is lowered to it rather than failing. */
+void limits_apply(unsigned mask, const rlim_t *limit)
+{
+    for (int k = 0; k < LIMIT_KINDS; k++)
+    {
+        if (!(mask & (1u << k)))
+        {
+            continue;
+        }
+        struct rlimit rl;
+        if (getrlimit(kinds[k].resource, &rl) < 0)
+        {
+            continue;
+        }
+        rl.rlim_cur = limit[k];
+        if (rl.rlim_max != RLIM_INFINITY && (rl.rlim_cur == RLIM_INFINITY || rl.rlim_cur > rl.rlim_max))
+        {
+            rl.rlim_cur = rl.rlim_max;
+        }
+        setrlimit(kinds[k].resource, &rl);
+    }
+}
+
+/* "10", "2G", "unlimited": value of kind k as a user would write it */
+static string format_value(int k, rlim_t value)
+{
+    if (value == RLIM_INFINITY)
+    {
+        return "unlimited";
+    }
+    char buf[32];
+    if (kinds[k].unit == 1)
+    {
+        snprintf(buf, sizeof(buf), "%llu", (unsigned long long)value);
+        return buf;
+    }
+    const char *suffixes = "KMGT";
+    int s = -1;
+    while (s < 3 && value && value % 1024 == 0)
+    {
+        value /= 1024;
+        s++;
+    }
+    if (s < 0)
+    {
+        snprintf(buf, sizeof(buf), "%lluB", (unsigned long long)value);
+    }
+    else
+    {
+        snprintf(buf, sizeof(buf), "%llu%c", (unsigned long long)value, suffixes[s]);
+    }
+    return buf;
+}
+
+/* Why p of job j died, when one of j's limits killed it: "cpu limit
+ * exceeded (cpu=10)".  Only the kernel's own signals for a limit count:
+ * SIGXCPU and SIGXFSZ, and SIGKILL once past the cpu hard limit.  A
+ * process that crashes when an allocation fails under as= or data= is
+ * reported by its signal like any other, so this is empty then. */
+string limits_exceeded(job_t *j, process_t *p)
+{
+    if (!p->completed || p->pid <= 0 || !j->limit_mask)
+    {
+        return "";
+    }
+    int k = -1;
+    if (WIFSIGNALED(p->status))
+    {
+        int sig = WTERMSIG(p->status);
+        double cpu = p->usage.ru_utime.tv_sec + p->usage.ru_stime.tv_sec
+                     + (p->usage.ru_utime.tv_usec + p->usage.ru_stime.tv_usec) / 1e6;
+        if ((j->limit_mask & (1u << LIMIT_CPU)) &&
+            (sig == SIGXCPU || (sig == SIGKILL && cpu >= j->limit[LIMIT_CPU])))
+        {
+            k = LIMIT_CPU;
+        }
+        else if ((j->limit_mask & (1u << LIMIT_FSIZE)) && sig == SIGXFSZ)
+        {
+            k = LIMIT_FSIZE;
+        }
+    }
+    if (k < 0 || j->limit[k] == RLIM_INFINITY)
+    {
+        return "";
+    }
+    return string(kinds[k].name) + " limit exceeded (" + kinds[k].name + "=" + format_value(k, j->limit[k]) + ")";
+}
+
+/* The ulimit builtin: no arguments or -a lists the defaults; -t 10 or
+ * cpu=10 (and so on) set one, "unlimited" clears it.  Returns what to print. */
+string limits_ulimit(int argc, char **argv)
+{
+    string out;
+    for (int i = 1; i < argc; i++)
+    {
+        int k = -1;
+        const char *value = NULL;
+        if (argv[i][0] == '-' && argv[i][1] && !argv[i][2] && argv[i][1] != 'a')
+        {
+            for (int n = 0; n < LIMIT_KINDS; n++)
+            {
+                if (kinds[n].flag == argv[i][1])
+                {
+                    k = n;
+                }
+            }
+            if (k >= 0 && i + 1 < argc)
+            {
+                value = argv[++i];
+            }
+        }
+        else if (strchr(argv[i], '='))
+        {
+            k = find_kind(argv[i], strchr(argv[i], '=') - argv[i]);
+            value = strchr(argv[i], '=') + 1;
+        }
+        else if (!strcmp(argv[i], "-a"))
+        {
+            continue;
+        }
+        rlim_t v;
+        if (k < 0 || !value || !parse_value(k, value, &v))
+        {
+            return string("ulimit: ") + argv[i] + ": invalid limit\n";
+        }
+        if (v == RLIM_INFINITY)
+        {
+            default_mask &= ~(1u << k);
+        }
+        else
+        {
+            default_limit[k] = v;
+            default_mask |= 1u << k;
+        }
+    }
+    if (argc > 1 && strcmp(argv[1], "-a"))
+    {
+        return out;
+    }
+    for (int k = 0; k < LIMIT_KINDS; k++)
+    {
+        char line[128];
+        string value = default_mask & (1u << k) ? format_value(k, default_limit[k]) : "unlimited";
+        snprintf(line, sizeof(line), "%-28s(-%c) %-8s %s\n", kinds[k].what, kinds[k].flag, kinds[k].name, value.c_str());
+        out += line;
+    }
+    return out;
+}
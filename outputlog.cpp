@@ -0,0 +1,195 @@
+#include "dsh.h"
+#include <glob.h>
+#include <sys/uio.h>
+#include <deque>
+
+using namespace std;
+
+/* output.log: everything dsh reports, as entries that each end in '~'.
+ * `history N` prints entry N of what is kept.
+ *
+ * log_output() used to keep the last 100 entries by reading the whole file,
+ * splitting it on '~' and writing a copy without the first entry, on every
+ * call once 100 commands had run; `history N` read and split the whole file
+ * as well.  The log is now a series of append-only segments instead:
+ * output.log is the one being written, and once it holds SEGMENT_ENTRIES
+ * entries it is renamed to output.log.<n> and a new one is started.
+ * Retention drops the oldest segment whole, so at least
+ * KEPT_SEGMENTS * SEGMENT_ENTRIES entries are kept.  An in-memory index
+ * holds the segment, offset and length of every entry kept, so writing an
+ * entry and reading entry N back are O(1) in the size of the log.
+ *
+ * A forked worker of the parallel for loop appends to the same output.log
+ * through the same open file, but only dsh indexes and rotates it: it picks
+ * up what workers wrote when it next writes itself. */
+
+#define SEGMENT_ENTRIES 25
+#define KEPT_SEGMENTS 4
+
+struct log_entry
+{
+    unsigned segment;       /* sequence number of its segment */
+    unsigned len;           /* bytes before its '~' */
+    off_t offset;           /* within the segment */
+};
+
+struct log_segment
+{
+    unsigned seq;
+    int fd;                 /* open for reading after it was renamed */
+    size_t entries;
+};
+
+static deque<log_segment> segments;     /* oldest first; back() is output.log */
+static deque<log_entry> entries;        /* every entry kept, oldest first */
+static uint64_t entries_dropped = 0;    /* entries before the oldest kept */
+static off_t indexed = 0;               /* bytes of output.log indexed so far */
+static off_t entry_start = 0;           /* where the entry being written began */
+static unsigned next_seq = 0;
+static bool rotating = true;            /* false in a forked worker */
+
+/* Start writing a fresh, empty output.log */
+static bool open_segment()
+{
+    int fd = open("output.log", O_RDWR | O_CREAT | O_TRUNC | O_APPEND | O_CLOEXEC, 0644);
+    if (fd < 0)
+    {
+        return false;
+    }
+    segments.push_back(log_segment{next_seq++, fd, 0});
+    indexed = entry_start = 0;
+    return true;
+}
+
+/* At startup: the segments of an earlier session go away */
+void log_open()
+{
+    glob_t g;
+    if (glob("output.log.*", 0, NULL, &g) == 0)
+    {
+        for (size_t i = 0; i < g.gl_pathc; i++)
+        {
+            unlink(g.gl_pathv[i]);
+        }
+    }
+    globfree(&g);
+    open_segment();
+}
+
+/* Index the entries in bytes [indexed, end) of output.log */
+static void index_to(off_t end)
+{
+    log_segment &seg = segments.back();
+    char buf[4096];
+    while (indexed < end)
+    {
+        ssize_t n = pread(seg.fd, buf, min((off_t)sizeof(buf), end - indexed), indexed);
+        if (n <= 0)
+        {
+            break;
+        }
+        for (ssize_t i = 0; i < n; i++)
+        {
+            if (buf[i] == '~')
+            {
+                off_t at = indexed + i;
+                entries.push_back(log_entry{seg.seq, (unsigned)(at - entry_start), entry_start});
+                seg.entries++;
+                entry_start = at + 1;
+            }
+        }
+        indexed += n;
+    }
+}
+
+/* output.log is full: it becomes output.log.<seq> and the oldest segment
+ * beyond KEPT_SEGMENTS goes away with its entries */
+static void rotate()
+{
+    log_segment &seg = segments.back();
+    char name[64];
+    snprintf(name, sizeof(name), "output.log.%u", seg.seq);
+    if (rename("output.log", name) < 0)
+    {
+        return;
+    }
+    if (!open_segment())
+    {
+        return;
+    }
+    while (segments.size() > KEPT_SEGMENTS + 1)
+    {
+        log_segment &old = segments.front();
+        snprintf(name, sizeof(name), "output.log.%u", old.seq);
+        unlink(name);
+        close(old.fd);
+        entries.erase(entries.begin(), entries.begin() + old.entries);
+        entries_dropped += old.entries;
+        segments.pop_front();
+    }
+}
+
+void log_output(char *output)
+{
+    if (segments.empty())
+    {
+        return;
+    }
+    log_segment &seg = segments.back();
+    struct iovec iov[2] = {{output, strlen(output)}, {(void *)"\n", 1}};
+    ssize_t n;
+    while ((n = writev(seg.fd, iov, 2)) < 0 && errno == EINTR)
+        ;
+    if (n <= 0 || !rotating)
+    {
+        return;
+    }
+    /* O_APPEND: the file position is now the end of what was just written */
+    off_t end = lseek(seg.fd, 0, SEEK_CUR);
+    index_to(end);
+    if (seg.entries >= SEGMENT_ENTRIES && entry_start == end - 1)
+    {
+        /* only the newline after the last '~' is left: nothing straddles */
+        rotate();
+    }
+    search_note_output();
+}
+
+/* Entries are numbered in the order written, from 0, for the search
+ * index; `history N` shows entry log_entries_begin() + N - 1 */
+uint64_t log_entries_begin()
+{
+    return entries_dropped;
+}
+
+uint64_t log_entries_end()
+{
+    return entries_dropped + entries.size();
+}
+
+/* Entry seq without its '~'; false when it is not kept */
+bool log_entry_at(uint64_t seq, string *text)
+{
+    if (seq < entries_dropped || seq >= log_entries_end())
+    {
+        return false;
+    }
+    const log_entry &e = entries[seq - entries_dropped];
+    const log_segment &seg = segments[e.segment - segments.front().seq];
+    text->resize(e.len);
+    ssize_t got = e.len ? pread(seg.fd, &(*text)[0], e.len, e.offset) : 0;
+    text->resize(got > 0 ? got : 0);
+    return true;
+}
+
+/* Entry n (1: the oldest kept) without its '~'; false when there is none */
+bool log_entry_text(size_t n, string *text)
+{
+    return n >= 1 && log_entry_at(entries_dropped + n - 1, text);
+}
+
+/* In a forked worker: append, but leave the index and rotation to dsh */
+void log_fork_child()
+{
+    rotating = false;
+}
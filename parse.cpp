@@ -1,4 +1,5 @@
 #include "dsh.h"
+#include <stdarg.h>
 
 job_t *find_last_job(job_t *first_job) {
     job_t *j = first_job;
@@ -8,19 +9,13 @@ job_t *find_last_job(job_t *first_job) {
     return j;
 }
 
-int isspace(int c) {
-    if (c == ' ') {
-        return 1;
-    }
-    return 0;
-} //check whether the char c is a space
-
 /* Initialize the members of job structure */
 bool init_job(job_t *j) 
 {
 	j->next = NULL;
-	if(!(j->commandinfo = (char *) calloc(MAX_LEN_CMDLINE,sizeof(char))))
-		return false;
+	j->prev = NULL;
+	j->id = 0;                      /* numbered by jobs_add() */
+	j->commandinfo = NULL;          /* filled in from the arena once the job's text is known */
 	j->first_process = NULL;
 	j->pgid = -1; 	                /* -1 indicates spawn new job*/
 	j->notified = false;
@@ -28,57 +23,138 @@ bool init_job(job_t *j)
 	j->mystdout = STDOUT_FILENO;	/* 1 */ 
 	j->mystderr = STDERR_FILENO;	/* 2 */
 	j->bg = false;
+	j->arena = NULL;
+	j->capture = NULL;
+	j->priority = 0;
+	j->queued = false;
+	j->timed = false;
+	j->limit_mask = 0;
+	j->place.set = 0;
+	j->stages = NULL;
 	return true;
 }
 
 /* Initialize the members of process structure */
-bool init_process(process_t *p) 
+bool init_process(process_t *p, arena_t *a) 
 {
 	p->pid = -1;                    /* -1 indicates new process */
 	p->completed = false;
 	p->stopped = false;
-	p->status = -1;                 /* set by waitpid */
+	p->status = -1;                 /* set by wait4 */
+	p->pidfd = -1;
+	memset(&p->usage, 0, sizeof(p->usage));
+	p->started.tv_sec = p->started.tv_nsec = 0;
+	p->ended = p->started;
 	p->argc = 0;
+	p->argv = NULL;                 /* built from words by process_argv() */
+	p->text = NULL;
 	p->next = NULL;
 	p->ifile = NULL;
 	p->ofile = NULL;
+	p->words = p->words_inline;
+	p->words_cap = INLINE_ARGS;
+	p->arg_bytes = sizeof(char *);  /* the argv NULL terminator */
+	return true;
+}
 
-	if(!(p->argv = (char **)calloc(MAX_ARGS,sizeof(char *))))
+/* Append a word span to p.  The first INLINE_ARGS words live inside the
+ * process itself; after that the storage doubles in the arena, so a command
+ * with thousands of file arguments costs O(log n) copies of the spans. */
+bool process_add_word(process_t *p, unsigned off, unsigned len, arena_t *a)
+{
+	static const size_t arg_max = sysconf(_SC_ARG_MAX) > 0 ? (size_t)sysconf(_SC_ARG_MAX) : 131072;
+	/* what execve() will be charged for this word: the string and its pointer */
+	if(p->arg_bytes + len + 1 + sizeof(char *) > arg_max) {
+		errno = E2BIG;
 		return false;
+	}
+	if(p->argc == p->words_cap) {
+		span_t *words = (span_t *)arena_alloc(a, 2 * p->words_cap * sizeof(span_t));
+		if(!words) {
+			errno = ENOMEM;
+			return false;
+		}
+		memcpy(words, p->words, p->argc * sizeof(span_t));
+		p->words = words;
+		p->words_cap *= 2;
+	}
+	p->words[p->argc].off = off;
+	p->words[p->argc].len = len;
+	p->argc++;
+	p->arg_bytes += len + 1 + sizeof(char *);
 	return true;
 }
 
-/*
- * Reads the process level information in the cases of single process or
- * cmdline with pipelines 
- *
- */
-
-bool readprocessinfo(process_t *p, char *cmd) 
+/* Turn the word spans of p into the NULL terminated argv exec_() expects.
+ * Parsing only records where the words are; they are copied out of the
+ * line the first time a process is about to run. */
+char **process_argv(job_t *j, process_t *p)
 {
+	if(p->argv)
+		return p->argv;
+	char **argv = p->argc < INLINE_ARGS + 1 ? p->argv_inline
+		: (char **)arena_alloc(j->arena, (p->argc + 1) * sizeof(char *));
+	if(!argv)
+		return NULL;
+	for(int i = 0; i < p->argc; i++) {
+		if(!(argv[i] = arena_strndup(j->arena, p->text + p->words[i].off, p->words[i].len)))
+			return NULL;
+	}
+	argv[p->argc] = NULL;           /* required for exec_() calls */
+	return p->argv = argv;
+}
 
-	int cmd_pos = 0;    /*iterator for command; */
-	int args_pos = 0;   /* iterator for arguments*/
-
-	int argc = 0;
-	
-	while (isspace(cmd[cmd_pos])){++cmd_pos;} /* ignore any spaces */
-	if(cmd[cmd_pos] == '\0')
-		return true;
-	
-	while(cmd[cmd_pos] != '\0'){
-		if(!(p->argv[argc] = (char *)calloc(MAX_LEN_CMDLINE, sizeof(char))))
-			return false;
-		while(cmd[cmd_pos] != '\0' && !isspace(cmd[cmd_pos])) 
-			p->argv[argc][args_pos++] = cmd[cmd_pos++];
-		p->argv[argc][args_pos] = '\0';
-		args_pos = 0;
-		++argc;
-		while (isspace(cmd[cmd_pos])){++cmd_pos;} /* ignore any spaces */
+typedef enum { TOK_WORD, TOK_LT, TOK_GT, TOK_PIPE, TOK_AMP, TOK_SEMI, TOK_EOL } tok_type_t;
+
+typedef struct token {
+	tok_type_t type;
+	unsigned off;               /* offset of the token in the line */
+	unsigned len;
+} token_t;
+
+typedef struct lexer {
+	const char *line;
+	size_t pos;
+	size_t len;
+} lexer_t;
+
+/* Produce the next token of the line.  Tokens are spans over the line, so
+ * the lexer never copies and looks at every byte exactly once; blank runs
+ * and words are classified a vector at a time by scan.cpp. A newline, a
+ * comment or the end of the string all read as TOK_EOL. */
+static void lex_next(lexer_t *lx, token_t *t)
+{
+	const char *s = lx->line;
+	size_t i = lx->pos;
+
+	i = scan_blanks_end(s, i, lx->len);
+	t->off = i;
+	t->len = 1;
+	if(i >= lx->len) {
+		t->type = TOK_EOL;
+		t->len = 0;
+		lx->pos = i;
+		return;
 	}
-	p->argv[argc] = NULL; /* required for exec_() calls */
-	p->argc = argc;
-	return true;
+	switch(s[i]) {
+	case '\n': case '\0': case '#':
+		t->type = TOK_EOL;
+		t->len = 0;
+		lx->pos = i;            /* sticky: keeps returning TOK_EOL */
+		return;
+	case '<': t->type = TOK_LT; break;
+	case '>': t->type = TOK_GT; break;
+	case '|': t->type = TOK_PIPE; break;
+	case '&': t->type = TOK_AMP; break;
+	case ';': t->type = TOK_SEMI; break;
+	default:
+		t->type = TOK_WORD;
+		i = scan_word_end(s, i, lx->len);
+		t->len = i - t->off;
+		lx->pos = i;
+		return;
+	}
+	lx->pos = i + 1;
 }
 
 /* Basic parser that fills the data structures job_t and process_t defined in
@@ -97,242 +173,224 @@ job_t* readcmdline(char *msg)
     if(isatty(0)) {
         fprintf(stdout, "%s", msg);
     }
+	/* queued background jobs keep starting while the prompt waits */
+	if(sched_pending()) {
+		fflush(stdout);
+		sched_idle(STDIN_FILENO);
+	}
         
-	char *cmdline = (char *)calloc(MAX_LEN_CMDLINE, sizeof(char));
-	if(!cmdline) {
-	    	fprintf(stderr, "%s\n","malloc: no space");
-        	return NULL;
-    	}
-	fgets(cmdline, MAX_LEN_CMDLINE, stdin);
+	/* the line only has to live until it is parsed, so one buffer is reused;
+	 * getline() grows it to whatever the longest line needs */
+	static char *cmdline = NULL;
+	static size_t cmdline_cap = 0;
+	if(getline(&cmdline, &cmdline_cap, stdin) < 0)
+		return NULL;
 	return readcommandline(cmdline);
 }
 
-job_t* readcommandline(const char* cmdline) {
-	if (strcmp(cmdline, "shell") == 0) {
-        job_t *newjob = (job_t *)malloc(sizeof(job_t));
-        init_job(newjob);
-        strcpy(newjob->commandinfo, cmdline);
-        return newjob;
-	}
-
-	/* sequence is true only when the command line contains ; */
-	bool sequence = false;
-	/* seq_pos is used for storing the command line before ; */
-	int seq_pos = 0;
+/* Set while the caller collects what the parser has to say, warnings
+ * included, rather than have it printed: by the cache, and on the batch
+ * parse-ahead thread, whose lines report theirs when their turn comes */
+thread_local std::string *parse_messages = NULL;
 
-	int cmdline_pos = 0; /*iterator for command line; */
-
-    	job_t *first_job = NULL;
+static void parse_error(const char *fmt, ...)
+{
+	va_list ap;
+	va_start(ap, fmt);
+	if(parse_messages) {
+		char buf[256];
+		vsnprintf(buf, sizeof(buf), fmt, ap);
+		parse_messages->append(buf);
+	} else {
+		vfprintf(stderr, fmt, ap);
+	}
+	va_end(ap);
+}
 
-	while(1) {
-		job_t *current_job = find_last_job(first_job);
+/* Print collected messages, or pass them on to an outer collector */
+void parse_report(const std::string &messages)
+{
+	if(messages.empty())
+		return;
+	if(parse_messages)
+		parse_messages->append(messages);
+	else
+		fputs(messages.c_str(), stderr);
+}
 
-		int cmd_pos = 0;        /* iterator for a command */
-		int iofile_seek = 0;    /*iofile_seek for file */
-		bool valid_input = true; /* check for valid input */
-		bool end_of_input = false; /* check for end of input */
+/* A parse error throws away everything built for the line at once */
+static job_t *parse_fail(arena_t *arena)
+{
+	arena_destroy(arena);
+	return NULL;
+}
 
-		/* cmdline is NOOP, i.e., just return with spaces */
-		while (isspace(cmdline[cmdline_pos])){++cmdline_pos;} /* ignore any spaces */
-		if(cmdline[cmdline_pos] == '\n' || cmdline[cmdline_pos] == '\0' || feof(stdin))
-			return NULL;
+/* Start a new job (and its first process) at the end of the job list */
+static job_t *new_job(arena_t *arena, const char *text, job_t **first_job, job_t *last_job)
+{
+	job_t *newjob = (job_t *)arena_alloc(arena, sizeof(job_t));
+	process_t *newprocess = (process_t *)arena_alloc(arena, sizeof(process_t));
+	if(!newjob || !newprocess || !init_job(newjob) || !init_process(newprocess, arena)) {
+		parse_error("%s\n","malloc: no space");
+		return NULL;
+	}
+	newjob->arena = arena;
+	arena_retain(arena);
+	newjob->first_process = newprocess;
+	newprocess->text = text;
+	if(!*first_job)
+		*first_job = newjob;
+	else
+		last_job->next = newjob;
+	return newjob;
+}
 
-		/* Check for invalid special symbols (characters) */
-		if(cmdline[cmdline_pos] == ';' || cmdline[cmdline_pos] == '&' 
-			|| cmdline[cmdline_pos] == '<' || cmdline[cmdline_pos] == '>' || cmdline[cmdline_pos] == '|')
-			return NULL;
+/* The parser proper; readcommandline() (cache.cpp) puts the parse cache in
+ * front of it */
+job_t* parse_commandline(const char* cmdline, size_t cmdline_len) {
 
-		char *cmd = (char *)calloc(MAX_LEN_CMDLINE, sizeof(char));
-		if(!cmd) {
-	        	fprintf(stderr, "%s\n","malloc: no space");
-            		return NULL;
-        	}
+	/* one arena per line, sized from the line itself: the single copy of
+	 * the text, the word spans and the argv built from them at exec time */
+	arena_t *arena = arena_create(2 * cmdline_len + 4 * (sizeof(job_t) + sizeof(process_t)) + 256);
+	if(!arena) {
+		parse_error("%s\n","malloc: no space");
+		return NULL;
+	}
 
-		job_t *newjob = (job_t *)malloc(sizeof(job_t));
-		if(!newjob) {
-	       		fprintf(stderr, "%s\n","malloc: no space");
-            		return NULL;
-        	}
+	if (cmdline_len == 5 && strncmp(cmdline, "shell", 5) == 0) {
+        job_t *newjob = (job_t *)arena_alloc(arena, sizeof(job_t));
+        init_job(newjob);
+        newjob->arena = arena;
+        arena_retain(arena);
+        newjob->commandinfo = arena_strndup(arena, cmdline, cmdline_len);
+        return newjob;
+	}
 
-		if(!first_job)
-			first_job = current_job = newjob;
-		else {
-			current_job->next = newjob;
-			current_job = current_job->next;
+	/* The only copy of the line.  Words stay spans into it; the end of each
+	 * job's text (its ; & # or newline) is overwritten with a NUL once lexed
+	 * so that commandinfo can point straight into it. */
+	char *text = arena_strndup(arena, cmdline, cmdline_len);
+	if(!text) {
+		parse_error("%s\n","malloc: no space");
+		return parse_fail(arena);
+	}
+	lexer_t lx = { text, 0, cmdline_len };
+	token_t t;
+
+	/* cmdline is NOOP, i.e., just return with spaces, or starts with an
+	 * invalid special symbol */
+	lex_next(&lx, &t);
+	if(t.type != TOK_WORD)
+		return parse_fail(arena);
+
+	job_t *first_job = NULL;
+	job_t *current_job = NULL;     /* job being filled; NULL right after ; */
+	job_t *last_job = NULL;
+	process_t *current_process = NULL;
+	bool valid_input = true;    /* false after a redirection, until the next | */
+	bool end_of_input = false;
+
+	while(!end_of_input) {
+		if(!current_job) {
+			if(!(current_job = new_job(arena, text, &first_job, last_job)))
+				return parse_fail(arena);
+			last_job = current_job;
+			current_job->commandinfo = text + t.off;
+			current_process = current_job->first_process;
+			valid_input = true;
 		}
 
-		if(!init_job(current_job)) {
-	        	fprintf(stderr, "%s\n","malloc: no space");
-			delete_job(current_job,first_job);
-            		return NULL;
-        	}
+		switch(t.type) {
 
-        	process_t *newprocess = (process_t *)malloc(sizeof(process_t));
-		if(!newprocess) {
-	        	fprintf(stderr, "%s\n","malloc: no space");
-			delete_job(current_job,first_job);
-            		return NULL;
-        	}
-		if(!init_process(newprocess)){
-	        	fprintf(stderr, "%s\n","malloc: no space");
-			delete_job(current_job,first_job);
-            		return NULL;
-        	}
+		case TOK_WORD:
+			if(!valid_input) {
+				parse_error("%s\n", "reading cmdline: could not fathom input");
+				return parse_fail(arena);
+			}
+			if(!process_add_word(current_process, t.off, t.len, arena)) {
+				parse_error("reading cmdline: %s\n", strerror(errno));
+				return parse_fail(arena);
+			}
+			break;
 
-		process_t *current_process = NULL;
+		case TOK_LT: /* input redirection */
+		case TOK_GT: /* output redirection */
+		{
+			token_t file;
+			lex_next(&lx, &file);
+			if(file.type != TOK_WORD) {
+				parse_error("%s\n", "reading cmdline: could not fathom input");
+				return parse_fail(arena);
+			}
+			char *name = arena_strndup(arena, text + file.off, file.len);
+			if(!name) {
+				parse_error("%s\n", "malloc: no space");
+				return parse_fail(arena);
+			}
+			if(t.type == TOK_LT) {
+				current_process->ifile = name;
+				current_job->mystdin = INPUT_FD;
+			} else {
+				current_process->ofile = name;
+				current_job->mystdout = OUTPUT_FD;
+			}
+			valid_input = false;
+			break;
+		}
 
-		if(!current_job->first_process)
-			current_process = current_job->first_process = newprocess;
-		else {
+		case TOK_PIPE: /* pipeline */
+		{
+			if(current_process->argc == 0) {
+				parse_error("%s\n", "reading cmdline: could not fathom input");
+				return parse_fail(arena);
+			}
+			process_t *newprocess = (process_t *)arena_alloc(arena, sizeof(process_t));
+			if(!newprocess || !init_process(newprocess, arena)) {
+				parse_error("%s\n", "init_process: failed");
+				return parse_fail(arena);
+			}
+			newprocess->text = text;
 			current_process->next = newprocess;
-			current_process = current_process->next;
+			current_process = newprocess;
+			valid_input = true;
+			break;
 		}
 
-		while(cmdline[cmdline_pos] != '\n' && cmdline[cmdline_pos] != '\0') {
-
-			switch (cmdline[cmdline_pos]) {
-
-			    case '<': /* input redirection */
-                {
-                    current_process->ifile = (char *) calloc(MAX_LEN_FILENAME, sizeof(char));
-                    if (!current_process->ifile) {
-                        fprintf(stderr, "%s\n", "malloc: no space");
-                        delete_job(current_job, first_job);
-                        return NULL;
-                    }
-                    ++cmdline_pos;
-                    while (isspace(cmdline[cmdline_pos])) { ++cmdline_pos; } /* ignore any spaces */
-                    iofile_seek = 0;
-                    while (cmdline[cmdline_pos] != '\0' && !isspace(cmdline[cmdline_pos])) {
-                        if (MAX_LEN_FILENAME == iofile_seek) {
-                            fprintf(stderr, "%s\n", "malloc: no space");
-                            delete_job(current_job, first_job);
-                            return NULL;
-                        }
-                        current_process->ifile[iofile_seek++] = cmdline[cmdline_pos++];
-                    }
-                    current_process->ifile[iofile_seek] = '\0';
-                    current_job->mystdin = INPUT_FD;
-                    while (isspace(cmdline[cmdline_pos])) {
-                        if (cmdline[cmdline_pos] == '\n')
-                            break;
-                        ++cmdline_pos;
-                    }
-                    valid_input = false;
-                    break;
-                }
-			
-			    case '>': /* output redirection */
-                {
-                    current_process->ofile = (char *) calloc(MAX_LEN_FILENAME, sizeof(char));
-                    if (!current_process->ofile) {
-                        fprintf(stderr, "%s\n", "malloc: no space");
-                        delete_job(current_job, first_job);
-                        return NULL;
-                    }
-                    ++cmdline_pos;
-                    while (isspace(cmdline[cmdline_pos])) { ++cmdline_pos; } /* ignore any spaces */
-                    iofile_seek = 0;
-                    while (cmdline[cmdline_pos] != '\0' && !isspace(cmdline[cmdline_pos])) {
-                        if (MAX_LEN_FILENAME == iofile_seek) {
-                            fprintf(stderr, "%s\n", "malloc: no space");
-                            delete_job(current_job, first_job);
-                            return NULL;
-                        }
-                        current_process->ofile[iofile_seek++] = cmdline[cmdline_pos++];
-                    }
-                    current_process->ofile[iofile_seek] = '\0';
-                    current_job->mystdout = OUTPUT_FD;
-                    while (isspace(cmdline[cmdline_pos])) {
-                        if (cmdline[cmdline_pos] == '\n')
-                            break;
-                        ++cmdline_pos;
-                    }
-                    valid_input = false;
-                    break;
-                }
-
-			   case '|': /* pipeline */
-               {
-                   cmd[cmd_pos] = '\0';
-                   process_t *newprocess = (process_t *) malloc(sizeof(process_t));
-                   if (!newprocess) {
-                       fprintf(stderr, "%s\n", "malloc: no space");
-                       delete_job(current_job, first_job);
-                       return NULL;
-                   }
-                   if (!init_process(newprocess)) {
-                       fprintf(stderr, "%s\n", "init_process: failed");
-                       delete_job(current_job, first_job);
-                       return NULL;
-                   }
-                   if (!readprocessinfo(current_process, cmd)) {
-                       fprintf(stderr, "%s\n", "parse cmd: error");
-                       delete_job(current_job, first_job);
-                       return NULL;
-                   }
-                   current_process->next = newprocess;
-                   current_process = current_process->next;
-                   ++cmdline_pos;
-                   cmd_pos = 0; /*Reinitialze for new cmd */
-                   valid_input = true;
-                   break;
-               }
-			   case '&': /* background job */
-               {
-                   current_job->bg = true;
-                   while (isspace(cmdline[cmdline_pos])) { ++cmdline_pos; } /* ignore any spaces */
-                   if (cmdline[cmdline_pos + 1] != '\n' && cmdline[cmdline_pos + 1] != '\0')
-                       fprintf(stderr, "reading bg: extra input ignored");
-                   end_of_input = true;
-                   break;
-               }
-
-			   case ';': /* sequence of jobs*/
-               {
-                   sequence = true;
-                   strncpy(current_job->commandinfo, cmdline + seq_pos, cmdline_pos - seq_pos);
-                   seq_pos = cmdline_pos + 1;
-                   break;
-               }
-
-			   case '#': /* comment */
-               {
-                   end_of_input = true;
-                   break;
-               }
-
-			   default: {
-                   if (!valid_input) {
-                       fprintf(stderr, "%s\n", "reading cmdline: could not fathom input");
-                       delete_job(current_job, first_job);
-                       return NULL;
-                   }
-                   if (cmd_pos == MAX_LEN_CMDLINE - 1) {
-                       fprintf(stderr, "%s\n", "reading cmdline: length exceeds the max limit");
-                       delete_job(current_job, first_job);
-                       return NULL;
-                   }
-                   cmd[cmd_pos++] = cmdline[cmdline_pos++];
-                   break;
-               }
+		case TOK_AMP: /* background job */
+		case TOK_SEMI: /* sequence of jobs */
+		case TOK_EOL: /* end of line or comment */
+		{
+			if(current_process->argc == 0) {
+				parse_error("%s\n", "reading cmdline: could not fathom input");
+				return parse_fail(arena);
 			}
-			if(end_of_input || sequence)
-				break;
+			text[t.off] = '\0';    /* terminates current_job->commandinfo */
+			if(t.type == TOK_AMP) {
+				current_job->bg = true;
+				token_t extra;
+				lex_next(&lx, &extra);
+				if(extra.type != TOK_EOL)
+					parse_error("%s\n", "reading bg: extra input ignored");
+				end_of_input = true;
+			} else if(t.type == TOK_EOL) {
+				end_of_input = true;
+			}
+			current_job = NULL;
+			break;
 		}
-		cmd[cmd_pos] = '\0';
-		
-		if(!readprocessinfo(current_process, cmd)) {
-			fprintf(stderr,"%s\n","read process info: error");
-			delete_job(current_job,first_job);
-            		return NULL;
-        	}
-		if(!sequence) {
-			strncpy(current_job->commandinfo,cmdline+seq_pos,cmdline_pos-seq_pos);
+		}
+
+		if(end_of_input)
 			break;
+		lex_next(&lx, &t);
+		if(!current_job) {
+			if(t.type == TOK_EOL)   /* trailing ; */
+				break;
+			if(t.type != TOK_WORD) {
+				parse_error("%s\n", "reading cmdline: could not fathom input");
+				return parse_fail(arena);
+			}
 		}
-		sequence = false;
-		++cmdline_pos;
 	}
 	return first_job;
 }
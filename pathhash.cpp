@@ -0,0 +1,218 @@
+#include "dsh.h"
+#include <limits.h>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+using namespace std;
+
+/* Command path hash.  execvp() resolves a name by trying execve() on every
+ * PATH directory in turn; dsh does that walk once per name with stat() and
+ * remembers the absolute path, so the launch backends can exec it directly.
+ *
+ * An entry is only as good as the directory it was found in: a change of
+ * PATH drops the whole table, and a hit is trusted only while the mtime of
+ * that one directory is unchanged, so a hit costs a single stat() however
+ * far down PATH the command lives.  As with sh, a command of the same name
+ * added later to an earlier directory is not noticed until the entry is
+ * looked up again after hash -r, or after its own directory changed. */
+
+struct path_dir
+{
+    string name;
+    struct timespec mtime;  /* when the table entries for this dir were made */
+    bool seen;
+};
+
+struct path_entry
+{
+    string path;
+    size_t dir;             /* index into dirs, or PINNED */
+    unsigned long hits;
+};
+
+/* set with hash -p: not tied to a PATH directory, never revalidated */
+#define PINNED ((size_t)-1)
+
+static string hashed_path;                  /* PATH the table was built for */
+static vector<path_dir> dirs;
+static unordered_map<string, path_entry> table;
+
+static unsigned long path_hits = 0;
+static unsigned long path_walks = 0;
+
+static bool same_time(const struct timespec &a, const struct timespec &b)
+{
+    return a.tv_sec == b.tv_sec && a.tv_nsec == b.tv_nsec;
+}
+
+static void split_path(const char *path)
+{
+    dirs.clear();
+    const char *p = path;
+    while (1)
+    {
+        const char *colon = strchr(p, ':');
+        size_t len = colon ? (size_t)(colon - p) : strlen(p);
+        /* an empty entry means the current directory */
+        dirs.push_back(path_dir{len ? string(p, len) : string("."), {0, 0}, false});
+        if (!colon)
+        {
+            break;
+        }
+        p = colon + 1;
+    }
+}
+
+void path_hash_clear()
+{
+    table.clear();
+    dirs.clear();
+    hashed_path.clear();
+}
+
+/* Current mtime of dirs[i]; zero when it cannot be stat'ed */
+static struct timespec dir_mtime(size_t i)
+{
+    struct stat st;
+    if (stat(dirs[i].name.c_str(), &st) < 0)
+    {
+        return timespec{0, 0};
+    }
+    return st.st_mtim;
+}
+
+static bool dir_unchanged(size_t i)
+{
+    return dirs[i].seen && same_time(dir_mtime(i), dirs[i].mtime);
+}
+
+/* True while the directory an entry was found in is unchanged */
+static bool entry_fresh(const path_entry &e)
+{
+    return e.dir == PINNED || dir_unchanged(e.dir);
+}
+
+/* Forget every entry found in dirs[first..] and take their mtimes again */
+static void rescan_from(size_t first)
+{
+    for (auto it = table.begin(); it != table.end();)
+    {
+        if (it->second.dir >= first && it->second.dir != PINNED)
+        {
+            it = table.erase(it);
+        }
+        else
+        {
+            ++it;
+        }
+    }
+    for (size_t i = first; i < dirs.size(); i++)
+    {
+        dirs[i].seen = false;
+    }
+}
+
+static bool is_executable(const string &path)
+{
+    struct stat st;
+    return stat(path.c_str(), &st) == 0 && S_ISREG(st.st_mode) && access(path.c_str(), X_OK) == 0;
+}
+
+static void sync_path(const char *path)
+{
+    if (hashed_path != path)
+    {
+        path_hash_clear();
+        hashed_path = path;
+        split_path(path);
+    }
+}
+
+static const char *current_path()
+{
+    const char *path = getenv("PATH");
+    return path ? path : "/bin:/usr/bin";
+}
+
+/* Absolute path for command name, or NULL when no PATH directory has it.
+ * Names with a slash are returned as they are.  The result stays valid
+ * until the next lookup or path_hash_clear(). */
+const char *path_hash_lookup(const char *name)
+{
+    if (strchr(name, '/'))
+    {
+        return name;
+    }
+    sync_path(current_path());
+
+    auto it = table.find(name);
+    if (it != table.end())
+    {
+        if (entry_fresh(it->second))
+        {
+            path_hits++;
+            it->second.hits++;
+            return it->second.path.c_str();
+        }
+        /* what came from its directory on may be gone or shadowed now */
+        rescan_from(it->second.dir);
+    }
+
+    path_walks++;
+    for (size_t i = 0; i < dirs.size(); i++)
+    {
+        /* the mtime is taken before looking, so a file added meanwhile
+         * makes the next lookup walk again instead of being missed */
+        if (!dirs[i].seen)
+        {
+            dirs[i].mtime = dir_mtime(i);
+            dirs[i].seen = true;
+        }
+        string full = dirs[i].name + "/" + name;
+        if (is_executable(full))
+        {
+            path_entry &e = table[name];
+            e.path = full;
+            e.dir = i;
+            e.hits = 1;
+            return e.path.c_str();
+        }
+    }
+    return NULL;
+}
+
+/* hash -p: use path for name until the table is cleared */
+void path_hash_add(const char *name, const char *path)
+{
+    sync_path(current_path());
+    table[name] = path_entry{path, PINNED, 0};
+}
+
+void path_hash_stats(unsigned long *hits, unsigned long *walks, unsigned *entries)
+{
+    *hits = path_hits;
+    *walks = path_walks;
+    *entries = table.size();
+}
+
+/* Table contents for the hash builtin: "hits\tpath" lines, or with reusable
+ * set "hash -p path name" lines, which dsh reads back as they are */
+string path_hash_list(bool reusable)
+{
+    string out;
+    char line[PATH_MAX + 64];
+    for (auto &e : table)
+    {
+        if (reusable)
+        {
+            snprintf(line, sizeof(line), "hash -p %s %s\n", e.second.path.c_str(), e.first.c_str());
+        }
+        else
+        {
+            snprintf(line, sizeof(line), "%4lu\t%s\n", e.second.hits, e.second.path.c_str());
+        }
+        out += line;
+    }
+    return out;
+}
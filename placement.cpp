@@ -0,0 +1,273 @@
+#include "dsh.h"
+#include <sys/syscall.h>
+#include <string>
+
+using namespace std;
+
+/* Placement policy: where and how eagerly a job's processes run.  Every
+ * child used to inherit dsh's own CPU set, nice value and I/O priority, so
+ * a background build competed on equal terms with the command the user is
+ * waiting for.  A placement pins a job to a CPU set, renices it and sets its
+ * I/O scheduling class; it is set in each child before exec, or by dsh
+ * right after posix_spawn(), which has no attribute for any of them.
+ *
+ * A job gets its placement from run --cpus 4-7 --nice 10 --io idle cmd,
+ * and whatever it leaves out from the defaults for its kind: the place
+ * builtin sets them for foreground and background jobs.  Out of the box,
+ * background jobs run at nice +10 so the foreground stays responsive. */
+
+/* ioprio_set(2); glibc has no wrapper */
+#define IOPRIO_WHO_PROCESS 1
+#define IOPRIO_CLASS_SHIFT 13
+
+static const char *io_classes[] = { "none", "rt", "be", "idle" };
+
+static placement_t fg_default = { 0, {}, 0, 0, 0 };
+static placement_t bg_default = { PLACE_NICE, {}, 10, 0, 0 };
+
+/* "4-7", "0,2,8-11": false when malformed or out of range */
+static bool parse_cpus(const char *s, cpu_set_t *set)
+{
+    CPU_ZERO(set);
+    while (*s)
+    {
+        char *end;
+        long from = strtol(s, &end, 10);
+        long to = from;
+        if (end == s)
+        {
+            return false;
+        }
+        if (*end == '-')
+        {
+            s = end + 1;
+            to = strtol(s, &end, 10);
+            if (end == s)
+            {
+                return false;
+            }
+        }
+        if (from < 0 || to < from || to >= CPU_SETSIZE)
+        {
+            return false;
+        }
+        for (long c = from; c <= to; c++)
+        {
+            CPU_SET(c, set);
+        }
+        if (*end == ',')
+        {
+            end++;
+        }
+        else if (*end)
+        {
+            return false;
+        }
+        s = end;
+    }
+    return CPU_COUNT(set) > 0;
+}
+
+/* "idle", "be", "be:4" or "rt:0" */
+static bool parse_io(const char *s, int *io_class, int *io_level)
+{
+    const char *colon = strchr(s, ':');
+    size_t len = colon ? (size_t)(colon - s) : strlen(s);
+    for (int c = 1; c < 4; c++)
+    {
+        if (strlen(io_classes[c]) != len || strncmp(io_classes[c], s, len))
+        {
+            continue;
+        }
+        *io_class = c;
+        *io_level = 4; /* the kernel's default level within a class */
+        if (colon)
+        {
+            char *end;
+            long level = strtol(colon + 1, &end, 10);
+            if (end == colon + 1 || *end || level < 0 || level > 7)
+            {
+                return false;
+            }
+            *io_level = (int)level;
+        }
+        return true;
+    }
+    return false;
+}
+
+/* One option of run or place, with its value: --cpus LIST, --nice N or
+ * --io CLASS[:LEVEL].  Returns how many words it took (0: not an option
+ * of ours) or -1 when the value is malformed. */
+int place_option(placement_t *pl, int argc, char **argv)
+{
+    if (argc < 2)
+    {
+        return 0;
+    }
+    if (!strcmp(argv[0], "--cpus"))
+    {
+        if (!parse_cpus(argv[1], &pl->cpus))
+        {
+            return -1;
+        }
+        pl->set |= PLACE_CPUS;
+    }
+    else if (!strcmp(argv[0], "--nice"))
+    {
+        char *end;
+        long n = strtol(argv[1], &end, 10);
+        if (end == argv[1] || *end || n < -20 || n > 19)
+        {
+            return -1;
+        }
+        pl->nice = (int)n;
+        pl->set |= PLACE_NICE;
+    }
+    else if (!strcmp(argv[0], "--io"))
+    {
+        if (!parse_io(argv[1], &pl->io_class, &pl->io_level))
+        {
+            return -1;
+        }
+        pl->set |= PLACE_IO;
+    }
+    else
+    {
+        return 0;
+    }
+    return 2;
+}
+
+/* Fill in what j's own placement leaves out from the fg or bg defaults */
+void place_merge(job_t *j, bool fg)
+{
+    const placement_t *d = fg ? &fg_default : &bg_default;
+    placement_t *pl = &j->place;
+    if ((d->set & PLACE_CPUS) && !(pl->set & PLACE_CPUS))
+    {
+        pl->cpus = d->cpus;
+    }
+    if ((d->set & PLACE_NICE) && !(pl->set & PLACE_NICE))
+    {
+        pl->nice = d->nice;
+    }
+    if ((d->set & PLACE_IO) && !(pl->set & PLACE_IO))
+    {
+        pl->io_class = d->io_class;
+        pl->io_level = d->io_level;
+    }
+    pl->set |= d->set;
+}
+
+/* Place process pid (0: the calling one), in a new child before exec or
+ * from dsh right after posix_spawn().  The nice value is an increment over
+ * dsh's own, as with nice(1); lowering it needs privileges and is skipped
+ * quietly without them, as is a CPU set with no CPU left online. */
+void place_apply(const placement_t *pl, pid_t pid)
+{
+    if (pl->set & PLACE_CPUS)
+    {
+        sched_setaffinity(pid, sizeof(pl->cpus), &pl->cpus);
+    }
+    if ((pl->set & PLACE_NICE) && pl->nice)
+    {
+        errno = 0;
+        int now = getpriority(PRIO_PROCESS, 0);
+        if (errno == 0)
+        {
+            setpriority(PRIO_PROCESS, pid, now + pl->nice);
+        }
+    }
+    if (pl->set & PLACE_IO)
+    {
+        syscall(SYS_ioprio_set, IOPRIO_WHO_PROCESS, pid, (pl->io_class << IOPRIO_CLASS_SHIFT) | pl->io_level);
+    }
+}
+
+static string format_place(const placement_t *pl)
+{
+    string out = "cpus ";
+    if (pl->set & PLACE_CPUS)
+    {
+        bool first = true;
+        for (int c = 0; c < CPU_SETSIZE; c++)
+        {
+            if (!CPU_ISSET(c, &pl->cpus))
+            {
+                continue;
+            }
+            int last = c;
+            while (last + 1 < CPU_SETSIZE && CPU_ISSET(last + 1, &pl->cpus))
+            {
+                last++;
+            }
+            out += first ? "" : ",";
+            out += to_string(c);
+            if (last > c)
+            {
+                out += "-" + to_string(last);
+            }
+            first = false;
+            c = last;
+        }
+    }
+    else
+    {
+        out += "inherited";
+    }
+    char rest[64];
+    snprintf(rest, sizeof(rest), ", nice %+d", pl->set & PLACE_NICE ? pl->nice : 0);
+    out += rest;
+    if (pl->set & PLACE_IO)
+    {
+        snprintf(rest, sizeof(rest), ", io %s:%d", io_classes[pl->io_class], pl->io_level);
+        out += rest;
+    }
+    else
+    {
+        out += ", io inherited";
+    }
+    return out;
+}
+
+/* The place builtin: place [fg|bg [--cpus LIST] [--nice N] [--io CLASS]
+ * [--reset]] sets the defaults of one kind of job and prints them all */
+string place_builtin(int argc, char **argv)
+{
+    const char *usage = "Error: usage: place [fg|bg [--cpus LIST] [--nice N] [--io idle|be[:N]|rt[:N]] [--reset]]\n";
+    if (argc > 1)
+    {
+        placement_t *d;
+        if (!strcmp(argv[1], "fg"))
+        {
+            d = &fg_default;
+        }
+        else if (!strcmp(argv[1], "bg"))
+        {
+            d = &bg_default;
+        }
+        else
+        {
+            return usage;
+        }
+        placement_t next = *d;
+        for (int i = 2; i < argc;)
+        {
+            if (!strcmp(argv[i], "--reset"))
+            {
+                next.set = 0;
+                i++;
+                continue;
+            }
+            int used = place_option(&next, argc - i, argv + i);
+            if (used <= 0)
+            {
+                return usage;
+            }
+            i += used;
+        }
+        *d = next;
+    }
+    return "fg: " + format_place(&fg_default) + "\nbg: " + format_place(&bg_default) + "\n";
+}
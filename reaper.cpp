@@ -0,0 +1,212 @@
+#include "dsh.h"
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <mutex>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+using namespace std;
+
+/* Background reaper.  Background processes used to be reaped only when the
+ * main thread next looked at the job list, so a script firing off hundreds
+ * of & jobs left hundreds of zombies behind.  Now a reaper thread holds a
+ * pidfd for each background process and reaps it the moment it exits.
+ *
+ * The thread never touches the job table.  It queues each exit with the
+ * process it was watching for, and the main thread applies it with
+ * reaper_collect() when it next prunes the job list, right before the
+ * prompt, to that very process: by then the job may be gone and its pid
+ * given to another one.  SIGCHLD itself stays on
+ * the signalfd of events.cpp, which only the foreground wait reads.
+ *
+ * Reaping and queueing happen under one lock, so once reaper_forget() has
+ * returned, the pid's exit is either in the queue or still unreaped.  An
+ * eventfd polls readable while the queue is not empty, for a main thread
+ * that waits on background jobs (the scheduler). */
+
+struct reaped
+{
+    pid_t pid;
+    process_t *p;           /* compared, never dereferenced on this thread */
+    int status;
+    struct rusage usage;
+    struct timespec ended;
+};
+
+static mutex reaper_lock;
+struct watch
+{
+    int fd;                 /* the reaper's own pidfd */
+    process_t *p;
+};
+
+static unordered_map<pid_t, watch> watched;
+static vector<reaped> queue;
+static int reaper_epoll = -1;
+static int reaper_event = -1;
+static once_flag reaper_started;
+
+static void reaper_loop()
+{
+    struct epoll_event events[32];
+    while (1)
+    {
+        int n = epoll_wait(reaper_epoll, events, 32, -1);
+        for (int i = 0; i < n; i++)
+        {
+            pid_t pid = events[i].data.fd;
+            lock_guard<mutex> guard(reaper_lock);
+            auto it = watched.find(pid);
+            if (it == watched.end())
+            {
+                continue; /* forgotten meanwhile */
+            }
+            reaped done;
+            pid_t r = wait4(pid, &done.status, WNOHANG, &done.usage);
+            if (r == 0)
+            {
+                continue;
+            }
+            if (r == pid)
+            {
+                done.pid = pid;
+                done.p = it->second.p;
+                clock_gettime(CLOCK_MONOTONIC, &done.ended);
+                queue.push_back(done);
+                uint64_t one = 1;
+                if (reaper_event >= 0 && write(reaper_event, &one, sizeof(one)) < 0)
+                {
+                    /* only a wakeup; the queue itself is what counts */
+                }
+            }
+            /* reaped, or ECHILD because the main thread got there first */
+            close(it->second.fd);
+            watched.erase(it);
+        }
+    }
+}
+
+static void reaper_start()
+{
+    reaper_epoll = epoll_create1(EPOLL_CLOEXEC);
+    reaper_event = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    if (reaper_epoll >= 0)
+    {
+        thread(reaper_loop).detach();
+    }
+}
+
+/* Reap pid in the background as soon as it exits.  false when this kernel
+ * has no pidfds; the job is then polled from the main thread. */
+bool reaper_watch(process_t *p)
+{
+    if (p->pidfd < 0 || p->completed)
+    {
+        return false;
+    }
+    call_once(reaper_started, reaper_start);
+    int fd = dup(p->pidfd);
+    if (reaper_epoll < 0 || fd < 0)
+    {
+        if (fd >= 0)
+        {
+            close(fd);
+        }
+        return false;
+    }
+    fcntl(fd, F_SETFD, FD_CLOEXEC);
+
+    lock_guard<mutex> guard(reaper_lock);
+    if (watched.count(p->pid))
+    {
+        close(fd);
+        return true;
+    }
+    struct epoll_event ev;
+    ev.events = EPOLLIN;
+    ev.data.fd = p->pid;
+    if (epoll_ctl(reaper_epoll, EPOLL_CTL_ADD, fd, &ev) < 0)
+    {
+        close(fd);
+        return false;
+    }
+    watched[p->pid] = watch{fd, p};
+    return true;
+}
+
+/* An fd that polls readable while exits wait for reaper_collect(), or -1 */
+int reaper_event_fd()
+{
+    return reaper_epoll >= 0 ? reaper_event : -1;
+}
+
+/* True once background processes go through the reaper */
+bool reaper_active()
+{
+    return reaper_epoll >= 0;
+}
+
+/* In a forked worker: there is no reaper thread, and what it queued
+ * belongs to dsh; the worker polls its own jobs */
+void reaper_fork_child()
+{
+    if (reaper_epoll >= 0)
+    {
+        close(reaper_epoll);
+        reaper_epoll = -1;
+    }
+    if (reaper_event >= 0)
+    {
+        close(reaper_event);
+        reaper_event = -1;
+    }
+}
+
+/* Take pid back, for a job brought to the foreground */
+void reaper_forget(pid_t pid)
+{
+    lock_guard<mutex> guard(reaper_lock);
+    auto it = watched.find(pid);
+    if (it != watched.end())
+    {
+        close(it->second.fd); /* drops it from the epoll set too */
+        watched.erase(it);
+    }
+}
+
+/* Hand the queued exits to the job table: each status is stored in the
+ * process it belongs to, if the table still holds that process under its
+ * pid.  Runs on the main thread only. */
+void reaper_collect(process_t *(*find)(pid_t pid))
+{
+    vector<reaped> ready;
+    if (reaper_epoll < 0)
+    {
+        return;
+    }
+    {
+        lock_guard<mutex> guard(reaper_lock);
+        if (queue.empty())
+        {
+            return;
+        }
+        ready.swap(queue);
+        uint64_t count;
+        if (reaper_event >= 0 && read(reaper_event, &count, sizeof(count)) < 0)
+        {
+            /* already reset */
+        }
+    }
+    for (auto &r : ready)
+    {
+        process_t *p = find(r.pid);
+        if (p && p == r.p && !p->completed)
+        {
+            p->completed = true;
+            p->status = r.status;
+            usage_finished(p, &r.usage, &r.ended);
+            unwatch_process(p);
+        }
+    }
+}
@@ -0,0 +1,192 @@
+#include "dsh.h"
+
+#if defined(__x86_64__) || (defined(__i386__) && defined(__SSE2__))
+#include <immintrin.h>
+#define SCAN_X86 1
+#endif
+
+/* Byte classifiers for the lexer in parse.cpp.  scan_word_end() finds the
+ * next shell metacharacter or blank (the end of a word) and scan_blanks_end()
+ * the end of a run of blanks, 32 bytes at a time with AVX2 and 16 with SSE2
+ * (always present on x86-64).  The bytes left over at the end of the line,
+ * and all of it on other architectures, go through the scalar loops. */
+
+/* characters that end a word; keep in sync with the token switch in lex_next() */
+static inline bool is_delim(char c)
+{
+	switch(c) {
+	case ' ': case '\t': case '\r': case '\n': case '\0':
+	case '<': case '>': case '|': case '&': case ';': case '#':
+		return true;
+	default:
+		return false;
+	}
+}
+
+static inline bool is_blank(char c)
+{
+	return c == ' ' || c == '\t' || c == '\r';
+}
+
+static size_t scalar_word_end(const char *s, size_t i, size_t len)
+{
+	while(i < len && !is_delim(s[i]))
+		++i;
+	return i;
+}
+
+static size_t scalar_blanks_end(const char *s, size_t i, size_t len)
+{
+	while(i < len && is_blank(s[i]))
+		++i;
+	return i;
+}
+
+#ifdef SCAN_X86
+
+static inline __m128i delim_mask16(__m128i v)
+{
+	__m128i m = _mm_cmpeq_epi8(v, _mm_set1_epi8(' '));
+	m = _mm_or_si128(m, _mm_cmpeq_epi8(v, _mm_set1_epi8('\t')));
+	m = _mm_or_si128(m, _mm_cmpeq_epi8(v, _mm_set1_epi8('\r')));
+	m = _mm_or_si128(m, _mm_cmpeq_epi8(v, _mm_set1_epi8('\n')));
+	m = _mm_or_si128(m, _mm_cmpeq_epi8(v, _mm_setzero_si128()));
+	m = _mm_or_si128(m, _mm_cmpeq_epi8(v, _mm_set1_epi8('<')));
+	m = _mm_or_si128(m, _mm_cmpeq_epi8(v, _mm_set1_epi8('>')));
+	m = _mm_or_si128(m, _mm_cmpeq_epi8(v, _mm_set1_epi8('|')));
+	m = _mm_or_si128(m, _mm_cmpeq_epi8(v, _mm_set1_epi8('&')));
+	m = _mm_or_si128(m, _mm_cmpeq_epi8(v, _mm_set1_epi8(';')));
+	m = _mm_or_si128(m, _mm_cmpeq_epi8(v, _mm_set1_epi8('#')));
+	return m;
+}
+
+static inline __m128i blank_mask16(__m128i v)
+{
+	__m128i m = _mm_cmpeq_epi8(v, _mm_set1_epi8(' '));
+	m = _mm_or_si128(m, _mm_cmpeq_epi8(v, _mm_set1_epi8('\t')));
+	m = _mm_or_si128(m, _mm_cmpeq_epi8(v, _mm_set1_epi8('\r')));
+	return m;
+}
+
+static size_t sse2_word_end(const char *s, size_t i, size_t len)
+{
+	for(; i + 16 <= len; i += 16) {
+		__m128i v = _mm_loadu_si128((const __m128i *)(s + i));
+		unsigned bits = _mm_movemask_epi8(delim_mask16(v));
+		if(bits)
+			return i + __builtin_ctz(bits);
+	}
+	return scalar_word_end(s, i, len);
+}
+
+static size_t sse2_blanks_end(const char *s, size_t i, size_t len)
+{
+	for(; i + 16 <= len; i += 16) {
+		__m128i v = _mm_loadu_si128((const __m128i *)(s + i));
+		unsigned bits = ~_mm_movemask_epi8(blank_mask16(v)) & 0xffff;
+		if(bits)
+			return i + __builtin_ctz(bits);
+	}
+	return scalar_blanks_end(s, i, len);
+}
+
+__attribute__((target("avx2")))
+static size_t avx2_word_end(const char *s, size_t i, size_t len)
+{
+	for(; i + 32 <= len; i += 32) {
+		__m256i v = _mm256_loadu_si256((const __m256i *)(s + i));
+		__m256i m = _mm256_cmpeq_epi8(v, _mm256_set1_epi8(' '));
+		m = _mm256_or_si256(m, _mm256_cmpeq_epi8(v, _mm256_set1_epi8('\t')));
+		m = _mm256_or_si256(m, _mm256_cmpeq_epi8(v, _mm256_set1_epi8('\r')));
+		m = _mm256_or_si256(m, _mm256_cmpeq_epi8(v, _mm256_set1_epi8('\n')));
+		m = _mm256_or_si256(m, _mm256_cmpeq_epi8(v, _mm256_setzero_si256()));
+		m = _mm256_or_si256(m, _mm256_cmpeq_epi8(v, _mm256_set1_epi8('<')));
+		m = _mm256_or_si256(m, _mm256_cmpeq_epi8(v, _mm256_set1_epi8('>')));
+		m = _mm256_or_si256(m, _mm256_cmpeq_epi8(v, _mm256_set1_epi8('|')));
+		m = _mm256_or_si256(m, _mm256_cmpeq_epi8(v, _mm256_set1_epi8('&')));
+		m = _mm256_or_si256(m, _mm256_cmpeq_epi8(v, _mm256_set1_epi8(';')));
+		m = _mm256_or_si256(m, _mm256_cmpeq_epi8(v, _mm256_set1_epi8('#')));
+		unsigned bits = (unsigned)_mm256_movemask_epi8(m);
+		if(bits)
+			return i + __builtin_ctz(bits);
+	}
+	return sse2_word_end(s, i, len);
+}
+
+__attribute__((target("avx2")))
+static size_t avx2_blanks_end(const char *s, size_t i, size_t len)
+{
+	for(; i + 32 <= len; i += 32) {
+		__m256i v = _mm256_loadu_si256((const __m256i *)(s + i));
+		__m256i m = _mm256_cmpeq_epi8(v, _mm256_set1_epi8(' '));
+		m = _mm256_or_si256(m, _mm256_cmpeq_epi8(v, _mm256_set1_epi8('\t')));
+		m = _mm256_or_si256(m, _mm256_cmpeq_epi8(v, _mm256_set1_epi8('\r')));
+		unsigned bits = ~(unsigned)_mm256_movemask_epi8(m);
+		if(bits)
+			return i + __builtin_ctz(bits);
+	}
+	return sse2_blanks_end(s, i, len);
+}
+
+#endif /* SCAN_X86 */
+
+typedef size_t (*scan_fn)(const char *s, size_t i, size_t len);
+
+typedef struct scan_impl {
+	scan_fn word_end;
+	scan_fn blanks_end;
+} scan_impl_t;
+
+/* Pick the widest implementation the CPU supports; DSH_SCAN=scalar|sse2
+ * forces a narrower one, which is handy for comparing them */
+static scan_impl_t scan_pick()
+{
+	scan_impl_t impl = { scalar_word_end, scalar_blanks_end };
+	const char *force = getenv("DSH_SCAN");
+#ifdef SCAN_X86
+	if(force && !strcmp(force, "scalar"))
+		return impl;
+	impl.word_end = sse2_word_end;
+	impl.blanks_end = sse2_blanks_end;
+	if(force && !strcmp(force, "sse2"))
+		return impl;
+	__builtin_cpu_init();
+	if(__builtin_cpu_supports("avx2")) {
+		impl.word_end = avx2_word_end;
+		impl.blanks_end = avx2_blanks_end;
+	}
+#else
+	(void)force;
+#endif
+	return impl;
+}
+
+static const scan_impl_t &scan()
+{
+	static const scan_impl_t impl = scan_pick();    /* thread-safe one-time init */
+	return impl;
+}
+
+/* Index of the first byte at or after i that ends a word, or len */
+size_t scan_word_end(const char *s, size_t i, size_t len)
+{
+	/* most words are short; do not pay for a vector load on them */
+	size_t head = len - i < 8 ? len : i + 8;
+	for(; i < head; ++i)
+		if(is_delim(s[i]))
+			return i;
+	if(i == len)
+		return i;
+	return scan().word_end(s, i, len);
+}
+
+/* Index of the first non-blank byte at or after i, or len */
+size_t scan_blanks_end(const char *s, size_t i, size_t len)
+{
+	/* a single separating blank is by far the common case */
+	if(i < len && is_blank(s[i]))
+		++i;
+	if(i >= len || !is_blank(s[i]))
+		return i;
+	return scan().blanks_end(s, i, len);
+}
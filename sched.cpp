@@ -0,0 +1,267 @@
+#include "dsh.h"
+#include <poll.h>
+#include <map>
+#include <unordered_map>
+#include <unordered_set>
+
+using namespace std;
+
+/* Background job scheduler.  A line ending in & used to be launched right
+ * away however many jobs were already running.  Now a background job only
+ * starts when the scheduler admits it:
+ *
+ *   - at most max_running admitted background jobs run at once (0: no limit)
+ *   - with max_load set, only while the 1 minute load average is below it
+ *   - with cpu_gate set, only while fewer tasks are runnable than there are
+ *     online CPUs (the running count of /proc/loadavg)
+ *
+ * The load gates never hold back a job while none of ours is running, so
+ * the queue always drains.  A job that is not admitted is listed in the job
+ * table as queued and waits in a queue ordered by priority (prio N cmd &),
+ * then by arrival.  Queued jobs are started by sched_dispatch() from the
+ * main thread: when finished jobs are pruned, while the prompt waits for
+ * input, and before dsh exits. */
+
+extern job_t *job_list;
+
+static int max_running = 0;
+static double max_load = 0;
+static bool cpu_gate = false;
+
+/* higher priority first, then first come first served */
+typedef pair<int, unsigned long> queue_key;
+
+static map<queue_key, job_t *> queue;
+static unordered_map<job_t *, queue_key> queued_key;
+static unordered_set<job_t *> admitted;
+static unsigned long arrivals = 0;
+
+/* Admitted background jobs still running, as of their latest statuses */
+static int running_jobs()
+{
+    reaper_collect(jobs_find_pid);
+    int n = 0;
+    for (job_t *j : admitted)
+    {
+        if (!reaper_active())
+        {
+            poll_job(j, false);
+        }
+        if (!job_is_stopped(j))
+        {
+            n++;
+        }
+    }
+    return n;
+}
+
+/* 1 minute load average and tasks runnable right now */
+static bool read_loadavg(double *load, int *runnable)
+{
+    FILE *f = fopen("/proc/loadavg", "r");
+    if (!f)
+    {
+        return false;
+    }
+    double l5, l15;
+    int total;
+    bool ok = fscanf(f, "%lf %lf %lf %d/%d", load, &l5, &l15, runnable, &total) == 5;
+    fclose(f);
+    return ok;
+}
+
+/* May one more background job start now? */
+bool sched_admit()
+{
+    int running = running_jobs();
+    if (max_running > 0 && running >= max_running)
+    {
+        return false;
+    }
+    if (running == 0 || (max_load <= 0 && !cpu_gate))
+    {
+        return true;
+    }
+    double load;
+    int runnable;
+    if (!read_loadavg(&load, &runnable))
+    {
+        return true;
+    }
+    if (max_load > 0 && load >= max_load)
+    {
+        return false;
+    }
+    /* the runnable count includes dsh itself, reading the file */
+    return !cpu_gate || runnable - 1 < sysconf(_SC_NPROCESSORS_ONLN);
+}
+
+/* Hold j back until it is admitted; j is already in the job table */
+void sched_enqueue(job_t *j)
+{
+    queue_key key(-j->priority, arrivals++);
+    queue[key] = j;
+    queued_key[j] = key;
+    j->queued = true;
+}
+
+/* Take j out of the queue, for fg or kill; false if it was not queued */
+bool sched_cancel(job_t *j)
+{
+    auto it = queued_key.find(j);
+    if (it == queued_key.end())
+    {
+        return false;
+    }
+    queue.erase(it->second);
+    queued_key.erase(it);
+    j->queued = false;
+    return true;
+}
+
+/* j was launched in the background: it counts against the limit */
+void sched_started(job_t *j)
+{
+    admitted.insert(j);
+}
+
+/* j is about to be freed */
+void sched_forget(job_t *j)
+{
+    admitted.erase(j);
+    sched_cancel(j);
+}
+
+bool sched_pending()
+{
+    return !queue.empty();
+}
+
+/* Start queued jobs, best first, for as long as they are admitted */
+void sched_dispatch()
+{
+    while (!queue.empty() && sched_admit())
+    {
+        job_t *j = queue.begin()->second;
+        sched_cancel(j);
+        spawn_job(j, false);
+    }
+}
+
+/* Pick up finished background processes and start what they make room for */
+static void sched_refresh()
+{
+    reaper_collect(jobs_find_pid);
+    if (!reaper_active())
+    {
+        poll_jobs(job_list);
+    }
+    sched_dispatch();
+}
+
+/* Sleep until a background process may have exited, for at most timeout_ms
+ * (-1: no limit), or until fd has input.  True when fd woke us. */
+static bool sched_sleep(int fd, int timeout_ms)
+{
+    struct pollfd fds[2];
+    int n = 0;
+    int event_fd = reaper_event_fd();
+    if (event_fd >= 0)
+    {
+        fds[n].fd = event_fd;
+        fds[n++].events = POLLIN;
+    }
+    else if (timeout_ms < 0 || timeout_ms > 200)
+    {
+        timeout_ms = 200; /* no reaper: poll the jobs instead */
+    }
+    if (fd >= 0)
+    {
+        fds[n].fd = fd;
+        fds[n++].events = POLLIN;
+    }
+    if (poll(fds, n, timeout_ms) <= 0)
+    {
+        return false;
+    }
+    return fd >= 0 && fds[n - 1].revents;
+}
+
+/* While the prompt waits on fd, keep starting queued jobs as room frees up */
+void sched_idle(int fd)
+{
+    while (sched_pending())
+    {
+        /* the load average moves on its own, so it is sampled once a second */
+        if (sched_sleep(fd, max_load > 0 || cpu_gate ? 1000 : -1))
+        {
+            return;
+        }
+        sched_refresh();
+    }
+}
+
+/* Run every queued job before dsh goes away */
+void sched_drain()
+{
+    sched_refresh();
+    while (sched_pending())
+    {
+        sched_sleep(-1, max_load > 0 || cpu_gate ? 1000 : -1);
+        sched_refresh();
+    }
+}
+
+/* In a forked worker: the queue and the running jobs are dsh's */
+void sched_fork_child()
+{
+    queue.clear();
+    queued_key.clear();
+    admitted.clear();
+    max_running = 0;
+    max_load = 0;
+    cpu_gate = false;
+}
+
+void sched_get_limits(int *running, double *load, bool *cpus)
+{
+    *running = max_running;
+    *load = max_load;
+    *cpus = cpu_gate;
+}
+
+void sched_set_limits(int running, double load, bool cpus)
+{
+    max_running = running;
+    max_load = load;
+    cpu_gate = cpus;
+}
+
+/* Settings and counts for the sched builtin */
+string sched_status()
+{
+    char line[256];
+    string out;
+    if (max_running > 0)
+    {
+        snprintf(line, sizeof(line), "max running: %d\n", max_running);
+    }
+    else
+    {
+        snprintf(line, sizeof(line), "max running: unlimited\n");
+    }
+    out += line;
+    if (max_load > 0)
+    {
+        snprintf(line, sizeof(line), "max load: %.2f\n", max_load);
+        out += line;
+    }
+    if (cpu_gate)
+    {
+        snprintf(line, sizeof(line), "gated on runnable CPUs: %ld online\n", sysconf(_SC_NPROCESSORS_ONLN));
+        out += line;
+    }
+    snprintf(line, sizeof(line), "running: %d, queued: %zu\n", running_jobs(), queue.size());
+    out += line;
+    return out;
+}
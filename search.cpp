@@ -0,0 +1,329 @@
+#include "dsh.h"
+#include <pthread.h>
+#include <stdint.h>
+#include <algorithm>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+using namespace std;
+
+/* history -s PATTERN: which past command lines, and which entries of
+ * output.log, contain PATTERN.
+ *
+ * Two trigram indexes answer it, one over the lines of the history file
+ * (every session's) and one over the output entries kept.  A document is
+ * numbered in the order it was indexed and each trigram maps to the sorted
+ * list of documents that contain it, so a query intersects the lists of
+ * the pattern's trigrams, shortest first, and only reads the few documents
+ * left to confirm the match.  Patterns under three bytes have no trigram
+ * and check every document.
+ *
+ * hist_add() and log_output() hand each entry over as it is written, so a
+ * query has next to nothing left to index; both sources number their
+ * entries in the order written, and lines other sessions added come along
+ * with the next one of ours.  The lines the history file already held at
+ * startup are indexed apart, on a thread search_open() starts, a few
+ * thousand at a time so that hist_add() never waits long for the store: a
+ * query waits at most for what that thread has left.  (output.log starts
+ * empty every session.)  Lines that were since erased or overwritten and
+ * entries retention dropped stay indexed until they outnumber the live
+ * ones, when the index is built over again; meanwhile confirming a match
+ * skips them.
+ *
+ * The reports of history -s are logged like any output, but never indexed:
+ * each would match its own pattern again, and every later query would find
+ * all the earlier reports of it. */
+
+#define BACKLOG_CHUNK 4096      /* lines indexed per hold of the store */
+
+struct text_index
+{
+    unordered_map<uint32_t, vector<uint32_t>> postings;     /* trigram -> documents */
+    vector<uint64_t> keys;      /* document -> history position or entry number */
+};
+
+static text_index commands;     /* lines added since startup; all of them once rebuilt */
+static text_index backlog;      /* lines held at startup, up to backlog_end */
+static text_index outputs;
+static hist_cursor_t commands_next = {0, 0};   /* where indexing carries on */
+static uint64_t outputs_next = 0;
+static unordered_set<uint64_t> reports;    /* output entries that are reports */
+
+static pthread_t backlog_thread;
+static bool backlog_running = false;
+static bool backlog_done = true;        /* backlog holds every line before backlog_end */
+static hist_cursor_t backlog_end = {0, 0};
+
+static void index_clear(text_index &ix)
+{
+    ix.postings.clear();
+    ix.keys.clear();
+}
+
+static void trigrams(const char *text, size_t len, vector<uint32_t> &out)
+{
+    out.clear();
+    for (size_t i = 0; i + 3 <= len; i++)
+    {
+        out.push_back((unsigned char)text[i] << 16 | (unsigned char)text[i + 1] << 8 | (unsigned char)text[i + 2]);
+    }
+    sort(out.begin(), out.end());
+    out.erase(unique(out.begin(), out.end()), out.end());
+}
+
+static void index_add(text_index &ix, uint64_t key, const char *text, size_t len)
+{
+    static thread_local vector<uint32_t> grams;
+    uint32_t doc = ix.keys.size();
+    ix.keys.push_back(key);
+    trigrams(text, len, grams);
+    for (uint32_t g : grams)
+    {
+        ix.postings[g].push_back(doc);
+    }
+}
+
+static bool add_command(uint64_t pos, const char *line, void *arg)
+{
+    index_add(commands, pos, line, strlen(line));
+    return true;
+}
+
+/* On backlog_thread: up to *left more of the lines before backlog_end */
+static bool add_backlog(uint64_t pos, const char *line, void *arg)
+{
+    size_t *left = (size_t *)arg;
+    if (pos >= backlog_end.pos || !*left)
+    {
+        return false;
+    }
+    (*left)--;
+    index_add(backlog, pos, line, strlen(line));
+    return true;
+}
+
+static void *index_backlog(void *arg)
+{
+    hist_cursor_t from = {0, backlog_end.file};
+    size_t left;
+    do
+    {
+        left = BACKLOG_CHUNK;
+        if (!hist_since(&from, add_backlog, &left))
+        {
+            return NULL; /* the file was replaced: positions mean nothing */
+        }
+    } while (!left);
+    backlog_done = true;
+    return NULL;
+}
+
+static void join_backlog()
+{
+    if (backlog_running)
+    {
+        pthread_join(backlog_thread, NULL);
+        backlog_running = false;
+    }
+}
+
+/* Index the command lines over again, from the oldest */
+static void drop_commands()
+{
+    join_backlog();
+    index_clear(backlog);
+    index_clear(commands);
+    backlog_done = true;
+    commands_next.pos = 0;
+    commands_next.file = 0;
+}
+
+static void index_commands()
+{
+    if (commands.keys.size() > 2 * hist_lines() + 64)
+    {
+        drop_commands(); /* mostly erased or overwritten lines */
+    }
+    if (!hist_since(&commands_next, add_command, NULL))
+    {
+        drop_commands();
+        hist_since(&commands_next, add_command, NULL);
+    }
+}
+
+static void index_outputs()
+{
+    uint64_t kept = log_entries_end() - log_entries_begin();
+    if (outputs.keys.size() > 2 * kept + 64)
+    {
+        index_clear(outputs); /* mostly entries retention dropped */
+        outputs_next = 0;
+    }
+    string text;
+    for (uint64_t seq = max(outputs_next, log_entries_begin()); seq < log_entries_end(); seq++)
+    {
+        if (reports.erase(seq))
+        {
+            continue;
+        }
+        if (log_entry_at(seq, &text))
+        {
+            index_add(outputs, seq, text.data(), text.size());
+        }
+    }
+    outputs_next = log_entries_end();
+}
+
+/* At startup, after hist_open(): index what the history file holds on a
+ * thread of its own */
+void search_open()
+{
+    hist_since(&commands_next, NULL, NULL);
+    backlog_end = commands_next;
+    if (!backlog_end.pos)
+    {
+        return;
+    }
+    backlog_done = false;
+    if (pthread_create(&backlog_thread, NULL, index_backlog, NULL) == 0)
+    {
+        backlog_running = true;
+    }
+    else
+    {
+        drop_commands(); /* the first line added indexes them all */
+    }
+}
+
+/* hist_add() wrote a line */
+void search_note_command()
+{
+    index_commands();
+}
+
+/* log_output() wrote an entry */
+void search_note_output()
+{
+    index_outputs();
+}
+
+/* A forked worker of the parallel for loop has no backlog_thread */
+void search_fork_child()
+{
+    if (backlog_running)
+    {
+        backlog_running = false;
+        drop_commands();
+    }
+}
+
+/* Index what is left before a query */
+static void catch_up()
+{
+    join_backlog();
+    if (!backlog_done || commands.keys.size() + backlog.keys.size() > 2 * hist_lines() + 64)
+    {
+        drop_commands();
+    }
+    index_commands();
+    index_outputs();
+}
+
+/* Documents of ix that may contain pattern, in order */
+static vector<uint32_t> candidates(const text_index &ix, const string &pattern)
+{
+    vector<uint32_t> grams;
+    trigrams(pattern.data(), pattern.size(), grams);
+    vector<uint32_t> docs;
+    if (grams.empty())
+    {
+        for (uint32_t d = 0; d < ix.keys.size(); d++)
+        {
+            docs.push_back(d);
+        }
+        return docs;
+    }
+    vector<const vector<uint32_t> *> lists;
+    for (uint32_t g : grams)
+    {
+        auto it = ix.postings.find(g);
+        if (it == ix.postings.end())
+        {
+            return docs;
+        }
+        lists.push_back(&it->second);
+    }
+    sort(lists.begin(), lists.end(),
+         [](const vector<uint32_t> *a, const vector<uint32_t> *b) { return a->size() < b->size(); });
+    docs = *lists[0];
+    for (size_t i = 1; i < lists.size() && !docs.empty(); i++)
+    {
+        vector<uint32_t> both;
+        set_intersection(docs.begin(), docs.end(), lists[i]->begin(), lists[i]->end(), back_inserter(both));
+        docs.swap(both);
+    }
+    return docs;
+}
+
+/* The report of history -s pattern: "command: LINE" for every history line
+ * that contains it, oldest first, then "output N: LINE" for every line of
+ * output entry N (as in history N) that does.  An earlier run of the same
+ * query is left out: it matches itself. */
+string history_search(const string &pattern)
+{
+    catch_up();
+    string out;
+    string text;
+    string query = "history -s " + pattern;
+    for (const text_index *ix : {&backlog, &commands})
+    {
+        for (uint32_t d : candidates(*ix, pattern))
+        {
+            if (!hist_line_at(ix->keys[d], &text))
+            {
+                continue;
+            }
+            if (text.compare(0, text.find_last_not_of(' ') + 1, query) != 0 && text.find(pattern) != string::npos)
+            {
+                out += "command: " + text + "\n";
+            }
+        }
+    }
+    for (uint32_t d : candidates(outputs, pattern))
+    {
+        uint64_t seq = outputs.keys[d];
+        if (!log_entry_at(seq, &text) || text.find(pattern) == string::npos)
+        {
+            continue;
+        }
+        char head[48];
+        snprintf(head, sizeof(head), "output %llu: ", (unsigned long long)(seq - log_entries_begin() + 1));
+        size_t start = 0;
+        while (start < text.size())
+        {
+            size_t end = text.find('\n', start);
+            if (end == string::npos)
+            {
+                end = text.size();
+            }
+            string line = text.substr(start, end - start);
+            if (line.find(pattern) != string::npos)
+            {
+                out += head + line + "\n";
+            }
+            start = end + 1;
+        }
+    }
+    if (out.empty())
+    {
+        out = "No match for " + pattern + "\n";
+    }
+    return out;
+}
+
+/* Entry seq of output.log is the report of a query: keep it out of the index */
+void history_search_logged(uint64_t seq)
+{
+    reports.insert(seq);
+}
@@ -0,0 +1,246 @@
+#include "dsh.h"
+#include <spawn.h>
+#include <time.h>
+#include <alloca.h>
+
+extern char **environ;
+extern int dsh_is_interactive;
+
+/* Process launch backends for spawn_job().
+ *
+ * SPAWN_FORK is the classic fork(): the child sets itself up with
+ * new_child() and redirect() before it execs.  Its cost grows with the
+ * shell's own address space, since fork has to copy every page table.
+ *
+ * SPAWN_POSIX hands the same setup to posix_spawn() as file actions and
+ * attributes.  glibc implements it with clone(CLONE_VM | CLONE_VFORK), so the
+ * launch costs the same no matter how big dsh's heap has grown.
+ *
+ * SPAWN_ZYGOTE sends the launch to a small helper process (zygote.cpp) that
+ * clones the child on dsh's behalf; if the helper cannot be reached the
+ * launch falls back to fork.
+ *
+ * A job under resource limits (limits.cpp) has them set in each child after
+ * new_child() and redirect(), right before the exec.  new_child() places the
+ * child on its CPUs and at its nice and I/O priority (placement.cpp);
+ * posix_spawn's child is placed by dsh once it exists.
+ *
+ * Both take the stdin/stdout the process should get as in_fd/out_fd (-1
+ * keeps dsh's own) and exec the path the command hash resolved, not the bare
+ * name, so neither walks PATH.  Those are expected to be O_CLOEXEC: the dup2 onto 0/1
+ * survives the exec and the originals do not leak into the child.  What
+ * execvp() would still have done past a failed exec of that path is left
+ * to exec_command(); posix_spawn() hands those cases to fork. */
+
+spawn_backend_t spawn_backend = SPAWN_FORK;
+
+static const char *backend_names[] = { "fork", "posix_spawn", "zygote" };
+
+const char *spawn_backend_name(spawn_backend_t b)
+{
+	return backend_names[b];
+}
+
+/* Select a backend by name; false when the name is unknown */
+bool set_spawn_backend(const char *name)
+{
+	for(int b = 0; b < SPAWN_BACKENDS; b++) {
+		if(!strcmp(name, backend_names[b])) {
+			spawn_backend = (spawn_backend_t)b;
+			return true;
+		}
+	}
+	return false;
+}
+
+/* exec path the way execvp() would have run argv[0]: a file without a #!
+ * line is a script for /bin/sh, and one we may not execute does not stop
+ * the search of the rest of PATH.  Returns only when all of that failed.
+ * Runs in the child of fork and of the zygote, so it never calls malloc. */
+void exec_command(const char *path, char **argv)
+{
+	execv(path, argv);
+	if(errno == ENOEXEC) {
+		int argc = 0;
+		while(argv[argc])
+			argc++;
+		char **sh_argv = (char **)alloca((argc + 2) * sizeof(char *));
+		sh_argv[0] = (char *)"sh";
+		sh_argv[1] = (char *)path;
+		for(int i = 1; i <= argc; i++)
+			sh_argv[i + 1] = argv[i];
+		execv("/bin/sh", sh_argv);
+	} else if(errno == EACCES) {
+		execvp(argv[0], argv);
+	}
+}
+
+static pid_t fork_launch(job_t *j, process_t *p, const char *path, bool fg, int in_fd, int out_fd)
+{
+	pid_t pid = fork();
+	switch(pid) {
+
+	case -1: /* fork failure */
+		perror("fork");
+		exit(EXIT_FAILURE);
+
+	case 0: /* child process  */
+		if(in_fd >= 0)
+			dup2(in_fd, STDIN_FILENO);
+		if(out_fd >= 0)
+			dup2(out_fd, STDOUT_FILENO);
+		new_child(j, p, fg);
+		redirect(p);
+		limits_apply(j->limit_mask, j->limit);
+		exec_command(path, p->argv);
+		exit(EXIT_FAILURE);
+
+	default: /* parent */
+		/* establish child process group */
+		p->pid = pid;
+		set_pgid(j, p);
+		return pid;
+	}
+}
+
+static pid_t posix_launch(job_t *j, process_t *p, const char *path, bool fg, int in_fd, int out_fd)
+{
+	posix_spawn_file_actions_t fa;
+	posix_spawnattr_t attr;
+	posix_spawn_file_actions_init(&fa);
+	posix_spawnattr_init(&attr);
+
+	if(in_fd >= 0)
+		posix_spawn_file_actions_adddup2(&fa, in_fd, STDIN_FILENO);
+	if(out_fd >= 0)
+		posix_spawn_file_actions_adddup2(&fa, out_fd, STDOUT_FILENO);
+	/* same rules as redirect(): a missing input file leaves stdin alone */
+	if(p->ifile && access(p->ifile, R_OK) == 0)
+		posix_spawn_file_actions_addopen(&fa, STDIN_FILENO, p->ifile, O_RDONLY, 0);
+	if(p->ofile)
+		posix_spawn_file_actions_addopen(&fa, STDOUT_FILENO, p->ofile, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+
+	/* what new_child() does: join the job's process group, take the
+	 * terminal when in the foreground, and get SIGINT back to default */
+	posix_spawnattr_setpgroup(&attr, j->pgid < 0 ? 0 : j->pgid);
+	sigset_t defaults;
+	sigemptyset(&defaults);
+	sigaddset(&defaults, SIGINT);
+	sigaddset(&defaults, SIGPIPE);
+	posix_spawnattr_setsigdefault(&attr, &defaults);
+	sigset_t mask;  /* dsh blocks SIGCHLD for its signalfd */
+	sigemptyset(&mask);
+	posix_spawnattr_setsigmask(&attr, &mask);
+	posix_spawnattr_setflags(&attr, POSIX_SPAWN_SETPGROUP | POSIX_SPAWN_SETSIGDEF | POSIX_SPAWN_SETSIGMASK);
+#if defined(__GLIBC__) && (__GLIBC__ > 2 || (__GLIBC__ == 2 && __GLIBC_MINOR__ >= 35))
+	if(fg && in_fd < 0 && dsh_is_interactive)
+		posix_spawn_file_actions_addtcsetpgrp_np(&fa, STDIN_FILENO);
+#endif
+
+	pid_t pid;
+	int err = posix_spawn(&pid, path, &fa, &attr, p->argv, environ);
+	if(err == EPERM && j->pgid > 0) {
+		/* the group is gone once all its members were reaped; fork's
+		 * child ignores the failed setpgid(), so start a fresh group */
+		posix_spawnattr_setpgroup(&attr, 0);
+		err = posix_spawn(&pid, path, &fa, &attr, p->argv, environ);
+	}
+	posix_spawn_file_actions_destroy(&fa);
+	posix_spawnattr_destroy(&attr);
+	if(err == ENOEXEC || err == EACCES)
+		return fork_launch(j, p, path, fg, in_fd, out_fd);
+	if(err) {
+		errno = err;
+		return -1;
+	}
+
+	p->pid = pid;
+	set_pgid(j, p);
+	/* no spawn attribute for these: placed from here, an instant late */
+	place_apply(&j->place, pid);
+	if(fg && in_fd < 0 && isatty(STDIN_FILENO))
+		seize_tty(j->pgid);
+	return pid;
+}
+
+/* Start process p of job j with the selected backend.  Returns the pid, or
+ * -1 with errno set when the command could not be started at all. */
+pid_t launch_process(job_t *j, process_t *p, bool fg, int in_fd, int out_fd)
+{
+	const char *path = path_hash_lookup(p->argv[0]);
+	if(!path) {
+		/* nothing on PATH: do not fork just to fail the exec */
+		errno = ENOENT;
+		return -1;
+	}
+	switch(spawn_backend) {
+	case SPAWN_POSIX:
+		/* posix_spawn has no way to set rlimits in the child */
+		if(j->limit_mask)
+			return fork_launch(j, p, path, fg, in_fd, out_fd);
+		return posix_launch(j, p, path, fg, in_fd, out_fd);
+	case SPAWN_ZYGOTE: {
+		pid_t pid = zygote_launch(j, p, path, fg, in_fd, out_fd);
+		if(pid >= 0 || errno != EAGAIN)
+			return pid;
+		return fork_launch(j, p, path, fg, in_fd, out_fd);
+	}
+	default:
+		return fork_launch(j, p, path, fg, in_fd, out_fd);
+	}
+}
+
+static double now_us()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1e6 + ts.tv_nsec / 1e3;
+}
+
+/* spawner -b: start /bin/true `launches` times with every backend and
+ * report the mean launch-to-reap time.  heap_mb of touched memory makes dsh
+ * look like a shell that has been running for a while. */
+std::string spawn_benchmark(int launches, int heap_mb)
+{
+	std::string out;
+	char line[256];
+	if(launches <= 0)
+		launches = 1;
+	/* the zygote is started before the heap grows, as init_dsh() would */
+	bool zygote = zygote_start();
+	char *heap = NULL;
+	if(heap_mb > 0 && (heap = (char *)malloc((size_t)heap_mb << 20)))
+		memset(heap, 1, (size_t)heap_mb << 20);
+
+	job_t *j = readcommandline("true");
+	process_t *p = j ? j->first_process : NULL;
+	if(!p || !process_argv(j, p)) {
+		free(heap);
+		return "spawner: cannot set up the benchmark\n";
+	}
+
+	spawn_backend_t saved = spawn_backend;
+	for(int b = 0; b < SPAWN_BACKENDS; b++) {
+		spawn_backend = (spawn_backend_t)b;
+		if(b == SPAWN_ZYGOTE && !zygote)
+			continue;
+		double start = now_us();
+		int failed = 0;
+		for(int i = 0; i < launches; i++) {
+			j->pgid = -1;
+			pid_t pid = launch_process(j, p, false, -1, -1);
+			if(pid < 0 || waitpid(pid, NULL, 0) < 0)
+				failed++;
+		}
+		double each = (now_us() - start) / launches;
+		snprintf(line, sizeof(line), "%-12s %d launches, %.1f us each%s\n",
+			 spawn_backend_name(spawn_backend), launches, each, failed ? " (some failed)" : "");
+		out += line;
+	}
+	spawn_backend = saved;
+	snprintf(line, sizeof(line), "heap: %d MB touched\n", heap ? heap_mb : 0);
+	out += line;
+	free_job(j);
+	free(heap);
+	return out;
+}
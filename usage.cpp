@@ -0,0 +1,170 @@
+#include "dsh.h"
+#include <sys/time.h>
+#include <string>
+
+using namespace std;
+
+/* Resource accounting.  Every process is reaped with wait4(), and the
+ * rusage that comes with its exit status is kept in its process_t along
+ * with monotonic launch and exit times.  jobs -v lists it per process, and
+ * the time prefix (time cmd | cmd ...) sums it up for a whole pipeline.
+ * A process still running has no rusage yet; jobs -v reads what the kernel
+ * has counted so far from /proc instead. */
+
+static double seconds(const struct timeval &tv)
+{
+    return tv.tv_sec + tv.tv_usec / 1e6;
+}
+
+static double elapsed(const struct timespec &from, const struct timespec &to)
+{
+    return (to.tv_sec - from.tv_sec) + (to.tv_nsec - from.tv_nsec) / 1e9;
+}
+
+/* Note the launch time of p */
+void usage_started(process_t *p)
+{
+    clock_gettime(CLOCK_MONOTONIC, &p->started);
+}
+
+/* p has terminated with status; ru and ended come from reaping it */
+void usage_finished(process_t *p, const struct rusage *ru, const struct timespec *ended)
+{
+    p->usage = *ru;
+    p->ended = *ended;
+}
+
+/* What the kernel has counted so far for the running process pid */
+static bool live_usage(pid_t pid, struct rusage *ru)
+{
+    memset(ru, 0, sizeof(*ru));
+    char path[64];
+    snprintf(path, sizeof(path), "/proc/%d/stat", (int)pid);
+    FILE *f = fopen(path, "r");
+    if (!f)
+    {
+        return false;
+    }
+    char buf[1024];
+    size_t n = fread(buf, 1, sizeof(buf) - 1, f);
+    fclose(f);
+    buf[n] = '\0';
+    /* fields after the command name, which may hold spaces: state is 3rd */
+    char *s = strrchr(buf, ')');
+    unsigned long utime, stime;
+    if (!s || sscanf(s + 2, "%*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u %lu %lu", &utime, &stime) != 2)
+    {
+        return false;
+    }
+    long hz = sysconf(_SC_CLK_TCK);
+    ru->ru_utime.tv_sec = utime / hz;
+    ru->ru_utime.tv_usec = (utime % hz) * 1000000 / hz;
+    ru->ru_stime.tv_sec = stime / hz;
+    ru->ru_stime.tv_usec = (stime % hz) * 1000000 / hz;
+
+    snprintf(path, sizeof(path), "/proc/%d/status", (int)pid);
+    if ((f = fopen(path, "r")))
+    {
+        char line[256];
+        while (fgets(line, sizeof(line), f))
+        {
+            sscanf(line, "VmHWM: %ld", &ru->ru_maxrss);
+            sscanf(line, "voluntary_ctxt_switches: %ld", &ru->ru_nvcsw);
+            sscanf(line, "nonvoluntary_ctxt_switches: %ld", &ru->ru_nivcsw);
+        }
+        fclose(f);
+    }
+    return true;
+}
+
+/* jobs -v: one line per process of j */
+string usage_lines(job_t *j)
+{
+    string out;
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    for (process_t *p = j->first_process; p; p = p->next)
+    {
+        char line[512];
+        const char *name = p->argv && p->argv[0] ? p->argv[0] : "?";
+        if (p->pid <= 0)
+        {
+            snprintf(line, sizeof(line), "      %-8s %s\n", "-", name);
+            out += line;
+            continue;
+        }
+        struct rusage ru;
+        double wall;
+        const char *state;
+        if (p->completed)
+        {
+            ru = p->usage;
+            wall = elapsed(p->started, p->ended);
+            state = "exited";
+        }
+        else
+        {
+            live_usage(p->pid, &ru);
+            wall = elapsed(p->started, now);
+            state = p->stopped ? "stopped" : "running";
+        }
+        snprintf(line, sizeof(line),
+                 "      %-8d %-8s user %.3fs sys %.3fs wall %.3fs maxrss %ldKB csw %ld/%ld  %s\n",
+                 (int)p->pid, state, seconds(ru.ru_utime), seconds(ru.ru_stime), wall,
+                 ru.ru_maxrss, ru.ru_nvcsw, ru.ru_nivcsw, name);
+        out += line;
+    }
+    return out;
+}
+
+static void bash_time(string &out, const char *label, double secs)
+{
+    char line[64];
+    snprintf(line, sizeof(line), "%s\t%dm%.3fs\n", label, (int)(secs / 60), secs - 60 * (int)(secs / 60));
+    out += line;
+}
+
+/* time cmd ...: totals for the whole pipeline j.  real runs from the first
+ * launch to the last exit; CPU times and context switches are summed and
+ * maxrss is the largest of any one process. */
+string usage_time_report(job_t *j)
+{
+    struct rusage total;
+    memset(&total, 0, sizeof(total));
+    struct timespec first = {0, 0}, last = {0, 0};
+    bool any = false;
+    for (process_t *p = j->first_process; p; p = p->next)
+    {
+        if (p->pid <= 0 || !p->completed)
+        {
+            continue;
+        }
+        if (!any || elapsed(p->started, first) > 0)
+        {
+            first = p->started;
+        }
+        if (!any || elapsed(last, p->ended) > 0)
+        {
+            last = p->ended;
+        }
+        any = true;
+        timeradd(&total.ru_utime, &p->usage.ru_utime, &total.ru_utime);
+        timeradd(&total.ru_stime, &p->usage.ru_stime, &total.ru_stime);
+        total.ru_nvcsw += p->usage.ru_nvcsw;
+        total.ru_nivcsw += p->usage.ru_nivcsw;
+        if (p->usage.ru_maxrss > total.ru_maxrss)
+        {
+            total.ru_maxrss = p->usage.ru_maxrss;
+        }
+    }
+
+    string out;
+    bash_time(out, "real", any ? elapsed(first, last) : 0);
+    bash_time(out, "user", seconds(total.ru_utime));
+    bash_time(out, "sys", seconds(total.ru_stime));
+    char line[128];
+    snprintf(line, sizeof(line), "maxrss\t%ldKB\ncsw\t%ld voluntary, %ld involuntary\n",
+             total.ru_maxrss, total.ru_nvcsw, total.ru_nivcsw);
+    out += line;
+    return out;
+}
@@ -0,0 +1,363 @@
+#include "dsh.h"
+#include <sys/mman.h>
+#include <sys/prctl.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <sched.h>
+#include <spawn.h>
+
+extern char **environ;
+extern int dsh_is_interactive;
+
+/* The zygote launch backend.
+ *
+ * fork() and even posix_spawn() pay for dsh itself: its page tables, its
+ * threads and signal state.  The zygote is a fresh dsh image, started as
+ * "dsh --zygote FD" with posix_spawn() of /proc/self/exe, that does nothing
+ * but wait on a socketpair: however big dsh has grown by the time it is
+ * started, by init_dsh() or by the spawner builtin, the zygote is as small
+ * as a dsh that has not read a line yet.  For each launch dsh sends it the resolved path, argv, the
+ * redirections and the job's pgid, with the pipe ends and dsh's current
+ * directory passed as SCM_RIGHTS: the zygote stays where dsh started.
+ * The zygote clones with CLONE_PARENT, so the new process is dsh's child
+ * (waitpid() and job control work unchanged) while the copy made is the
+ * zygote's small address space.
+ *
+ * The zygote never calls malloc(): without /proc it is forked from dsh
+ * instead, which may already run other threads. */
+
+#define ZYGOTE_FD_IN  1
+#define ZYGOTE_FD_OUT 2
+#define ZYGOTE_FD_CWD 4
+#define ZYGOTE_FDS    3
+
+typedef struct zygote_req {
+	pid_t pgid;         /* group to join, or -1 for a new one */
+	int fg;
+	int interactive;
+	int fds;            /* ZYGOTE_FD_* sent along */
+	int argc;
+	unsigned limit_mask;        /* the job's resource limits, as in job_t */
+	rlim_t limit[LIMIT_KINDS];
+	placement_t place;
+	size_t len;         /* bytes of strings that follow: path, ifile, ofile, argv */
+} zygote_req_t;
+
+typedef struct zygote_reply {
+	pid_t pid;
+	int err;
+} zygote_reply_t;
+
+static int zygote_fd = -1;     /* dsh's end of the socketpair */
+static pid_t zygote_pid = -1;
+
+static bool read_full(int fd, void *buf, size_t len)
+{
+	char *p = (char *)buf;
+	while(len) {
+		ssize_t n = read(fd, p, len);
+		if(n < 0 && errno == EINTR)
+			continue;
+		if(n <= 0)
+			return false;
+		p += n;
+		len -= n;
+	}
+	return true;
+}
+
+static bool write_full(int fd, const void *buf, size_t len)
+{
+	const char *p = (const char *)buf;
+	while(len) {
+		ssize_t n = write(fd, p, len);
+		if(n < 0 && errno == EINTR)
+			continue;
+		if(n <= 0)
+			return false;
+		p += n;
+		len -= n;
+	}
+	return true;
+}
+
+/* Runs in the new process: what new_child() and redirect() do for fork.
+ * fds holds the stdin, stdout and cwd fds sent, -1 for the others. */
+static void zygote_child(const zygote_req_t *req, int *fds, const char *path,
+			 const char *ifile, const char *ofile, char **argv)
+{
+	/* first: relative paths, the redirections' included, are dsh's */
+	if(fchdir(fds[2]) < 0)
+		_exit(EXIT_FAILURE);
+	if(req->fds & ZYGOTE_FD_IN)
+		dup2(fds[0], STDIN_FILENO);
+	if(req->fds & ZYGOTE_FD_OUT)
+		dup2(fds[1], STDOUT_FILENO);
+
+	if(setpgid(0, req->pgid < 0 ? 0 : req->pgid) < 0)
+		setpgid(0, 0);  /* the job's group is gone; see posix_launch() */
+	if(req->fg && req->interactive && !(req->fds & ZYGOTE_FD_IN))
+		tcsetpgrp(STDIN_FILENO, getpgrp());
+
+	signal(SIGINT, SIG_DFL);
+	signal(SIGQUIT, SIG_DFL);
+	signal(SIGTSTP, SIG_DFL);
+	signal(SIGPIPE, SIG_DFL);
+	events_child();
+	place_apply(&req->place, 0);
+
+	if(*ifile) {
+		int fd = open(ifile, O_RDONLY);
+		if(fd >= 0) {
+			dup2(fd, STDIN_FILENO);
+			close(fd);
+		}
+	}
+	if(*ofile) {
+		int fd = creat(ofile, 0644);
+		if(fd >= 0) {
+			dup2(fd, STDOUT_FILENO);
+			close(fd);
+		}
+	}
+	limits_apply(req->limit_mask, req->limit);
+	exec_command(path, argv);
+	_exit(EXIT_FAILURE);
+}
+
+/* The zygote's loop, on its end of the socketpair; main() hands "dsh
+ * --zygote FD" over to it before any setup */
+void zygote_main(int fd)
+{
+	prctl(PR_SET_NAME, "dsh-zygote"); /* not "exe", after /proc/self/exe */
+	/* ^C and ^Z at the prompt are for dsh, not for the zygote */
+	signal(SIGINT, SIG_IGN);
+	signal(SIGQUIT, SIG_IGN);
+	signal(SIGTSTP, SIG_IGN);
+
+	while(1) {
+		zygote_req_t req;
+		int got[ZYGOTE_FDS];
+		int fds[ZYGOTE_FDS] = { -1, -1, -1 };
+		char cbuf[CMSG_SPACE(ZYGOTE_FDS * sizeof(int))];
+		struct iovec iov = { &req, sizeof(req) };
+		struct msghdr msg;
+		memset(&msg, 0, sizeof(msg));
+		msg.msg_iov = &iov;
+		msg.msg_iovlen = 1;
+		msg.msg_control = cbuf;
+		msg.msg_controllen = sizeof(cbuf);
+
+		ssize_t n;
+		do {
+			n = recvmsg(fd, &msg, MSG_CMSG_CLOEXEC | MSG_WAITALL);
+		} while(n < 0 && errno == EINTR);
+		if(n != sizeof(req))
+			_exit(0);   /* dsh is gone */
+
+		int nfds = 0;
+		for(struct cmsghdr *c = CMSG_FIRSTHDR(&msg); c; c = CMSG_NXTHDR(&msg, c)) {
+			if(c->cmsg_level == SOL_SOCKET && c->cmsg_type == SCM_RIGHTS) {
+				nfds = (c->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+				memcpy(got, CMSG_DATA(c), nfds * sizeof(int));
+			}
+		}
+		/* the fds come in order, and only the ones flagged */
+		for(int i = 0, k = 0; i < ZYGOTE_FDS; i++) {
+			if((req.fds & (1 << i)) && k < nfds)
+				fds[i] = got[k++];
+		}
+		if(fds[2] < 0)
+			_exit(0);   /* not from our dsh */
+
+		/* strings, then the argv pointers at the next aligned offset */
+		size_t strings = (req.len + sizeof(char *) - 1) & ~(sizeof(char *) - 1);
+		size_t map_len = strings + (req.argc + 1) * sizeof(char *);
+		char *buf = (char *)mmap(NULL, map_len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+		if(buf == MAP_FAILED || !read_full(fd, buf, req.len))
+			_exit(0);
+		char **argv = (char **)(buf + strings);
+
+		char *s = buf;
+		const char *path = s;
+		s += strlen(s) + 1;
+		const char *ifile = s;
+		s += strlen(s) + 1;
+		const char *ofile = s;
+		s += strlen(s) + 1;
+		for(int i = 0; i < req.argc; i++) {
+			argv[i] = s;
+			s += strlen(s) + 1;
+		}
+		argv[req.argc] = NULL;
+
+		/* raw clone: fork() with the child handed to our parent */
+		zygote_reply_t reply;
+		reply.pid = syscall(SYS_clone, CLONE_PARENT | SIGCHLD, 0, 0, 0, 0);
+		reply.err = reply.pid < 0 ? errno : 0;
+		if(reply.pid == 0) {
+			close(fd);
+			zygote_child(&req, fds, path, ifile, ofile, argv);
+		}
+
+		for(int i = 0; i < ZYGOTE_FDS; i++) {
+			if(fds[i] >= 0)
+				close(fds[i]);
+		}
+		munmap(buf, map_len);
+		if(!write_full(fd, &reply, sizeof(reply)))
+			_exit(0);
+	}
+}
+
+/* Start the zygote; true when it is running */
+bool zygote_start()
+{
+	if(zygote_fd >= 0)
+		return true;
+
+	int sv[2];
+	if(socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, sv) < 0)
+		return false;
+
+	/* its end of the socketpair is the one fd the new image keeps; a dup2
+	 * onto a different number is what clears the close-on-exec flag */
+	int child_fd = sv[1] == 3 ? 4 : 3;
+	char fd_arg[16];
+	snprintf(fd_arg, sizeof(fd_arg), "%d", child_fd);
+	char *argv[] = { (char *)"dsh", (char *)"--zygote", fd_arg, NULL };
+	posix_spawn_file_actions_t fa;
+	posix_spawn_file_actions_init(&fa);
+	posix_spawn_file_actions_adddup2(&fa, sv[1], child_fd);
+	pid_t pid;
+	int err = posix_spawn(&pid, "/proc/self/exe", &fa, NULL, argv, environ);
+	posix_spawn_file_actions_destroy(&fa);
+	if(err) {
+		pid = fork(); /* no /proc: a copy of dsh as it is now */
+		if(pid < 0) {
+			close(sv[0]);
+			close(sv[1]);
+			return false;
+		}
+		if(pid == 0) {
+			close(sv[0]);
+			zygote_main(sv[1]);
+		}
+	}
+	close(sv[1]);
+	zygote_fd = sv[0];
+	zygote_pid = pid;
+	return true;
+}
+
+pid_t zygote_process()
+{
+	return zygote_pid;
+}
+
+/* Drop the zygote after it failed us; the next launch starts a new one */
+static void zygote_lost()
+{
+	close(zygote_fd);
+	zygote_fd = -1;
+	if(zygote_pid > 0) {
+		kill(zygote_pid, SIGKILL);
+		waitpid(zygote_pid, NULL, 0);
+	}
+	zygote_pid = -1;
+}
+
+/* Ask the zygote to start process p of job j.  Same contract as the other
+ * backends; -1 with errno EAGAIN when the zygote itself is unusable. */
+pid_t zygote_launch(job_t *j, process_t *p, const char *path, bool fg, int in_fd, int out_fd)
+{
+	if(!zygote_start()) {
+		errno = EAGAIN;
+		return -1;
+	}
+
+	const char *ifile = p->ifile && access(p->ifile, R_OK) == 0 ? p->ifile : "";
+	const char *ofile = p->ofile ? p->ofile : "";
+	zygote_req_t req;
+	memset(&req, 0, sizeof(req));
+	req.pgid = j->pgid;
+	req.fg = fg;
+	req.interactive = dsh_is_interactive;
+	req.argc = p->argc;
+	req.limit_mask = j->limit_mask;
+	memcpy(req.limit, j->limit, sizeof(req.limit));
+	req.place = j->place;
+	req.len = strlen(path) + strlen(ifile) + strlen(ofile) + 3;
+	for(int i = 0; i < p->argc; i++)
+		req.len += strlen(p->argv[i]) + 1;
+
+	/* the directory to run in, as it is now */
+	int cwd_fd = open(".", O_PATH | O_DIRECTORY | O_CLOEXEC);
+	if(cwd_fd < 0) {
+		errno = EAGAIN;
+		return -1;
+	}
+
+	int fds[ZYGOTE_FDS], nfds = 0;
+	if(in_fd >= 0) {
+		req.fds |= ZYGOTE_FD_IN;
+		fds[nfds++] = in_fd;
+	}
+	if(out_fd >= 0) {
+		req.fds |= ZYGOTE_FD_OUT;
+		fds[nfds++] = out_fd;
+	}
+	req.fds |= ZYGOTE_FD_CWD;
+	fds[nfds++] = cwd_fd;
+
+	char cbuf[CMSG_SPACE(ZYGOTE_FDS * sizeof(int))];
+	struct iovec iov = { &req, sizeof(req) };
+	struct msghdr msg;
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = cbuf;
+	msg.msg_controllen = CMSG_SPACE(nfds * sizeof(int));
+	struct cmsghdr *c = CMSG_FIRSTHDR(&msg);
+	c->cmsg_level = SOL_SOCKET;
+	c->cmsg_type = SCM_RIGHTS;
+	c->cmsg_len = CMSG_LEN(nfds * sizeof(int));
+	memcpy(CMSG_DATA(c), fds, nfds * sizeof(int));
+
+	ssize_t n;
+	do {
+		n = sendmsg(zygote_fd, &msg, MSG_NOSIGNAL);
+	} while(n < 0 && errno == EINTR);
+	close(cwd_fd);
+	bool ok = n == sizeof(req);
+	char *strings = ok ? (char *)malloc(req.len) : NULL;
+	if(strings) {
+		char *s = strings;
+		s = stpcpy(s, path) + 1;
+		s = stpcpy(s, ifile) + 1;
+		s = stpcpy(s, ofile) + 1;
+		for(int i = 0; i < p->argc; i++)
+			s = stpcpy(s, p->argv[i]) + 1;
+		ok = write_full(zygote_fd, strings, req.len);
+		free(strings);
+	} else {
+		ok = false;
+	}
+
+	zygote_reply_t reply;
+	if(!ok || !read_full(zygote_fd, &reply, sizeof(reply))) {
+		zygote_lost();
+		errno = EAGAIN;
+		return -1;
+	}
+	if(reply.pid < 0) {
+		errno = reply.err;
+		return -1;
+	}
+
+	p->pid = reply.pid;
+	set_pgid(j, p);
+	if(fg && in_fd < 0 && isatty(STDIN_FILENO))
+		seize_tty(j->pgid);
+	return reply.pid;
+}